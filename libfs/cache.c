@@ -0,0 +1,672 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "disk.h"
+
+#define cache_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Marks the end of a list and an empty hash bucket */
+#define NO_ENTRY -1
+
+/* Missing blocks of a range gathered into a single block_readv() at most, as
+ * many as the disk layer merges into a single request */
+#define READV_MAX 256
+
+/* Cached copy of a single disk block */
+struct cache_entry {
+	/* Disk block held by this entry */
+	size_t block;
+	/* Entry holds a block */
+	bool valid;
+	/* Entry differs from the disk */
+	bool dirty;
+	/* Entry is being filled by a prefetch, which failed */
+	bool loading;
+	bool load_failed;
+	/* Neighbours in the LRU list (most recently used first) */
+	int prev;
+	int next;
+	/* Next entry in the same hash bucket */
+	int hnext;
+};
+
+/* Cache instance description */
+struct cache {
+	/* Protects the entries and their data */
+	pthread_mutex_t lock;
+	/* Cache is open */
+	bool open;
+	/* Number of entries */
+	size_t count;
+	/* Entries and their block data */
+	struct cache_entry *entries;
+	uint8_t *data;
+	/* Hash buckets from block index to entry (power of two) */
+	int *buckets;
+	size_t bucket_mask;
+	/* Most and least recently used entries */
+	int head;
+	int tail;
+	/* Entries being filled by prefetches */
+	int *loading;
+	size_t nloading;
+	/* Dirty blocks being written back together */
+	struct block_vec *flushing;
+};
+
+static struct cache cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Range of blocks of an asynchronous write */
+struct write_req {
+	size_t block;
+	size_t count;
+};
+
+/* Asynchronous writes of the calling thread not waited for yet, whose cached
+ * copies are dropped if one of them fails */
+static __thread struct write_req *writes;
+static __thread size_t nwrites;
+static __thread size_t writes_capacity;
+
+static uint8_t *entry_data(int e)
+{
+	return cache.data + (size_t)e * BLOCK_SIZE;
+}
+
+static size_t bucket_of(size_t block)
+{
+	return (block * 2654435761u) & cache.bucket_mask;
+}
+
+static void lru_unlink(int e)
+{
+	struct cache_entry *entry = &cache.entries[e];
+
+	if (entry->prev != NO_ENTRY)
+		cache.entries[entry->prev].next = entry->next;
+	else
+		cache.head = entry->next;
+	if (entry->next != NO_ENTRY)
+		cache.entries[entry->next].prev = entry->prev;
+	else
+		cache.tail = entry->prev;
+}
+
+static void lru_push_front(int e)
+{
+	struct cache_entry *entry = &cache.entries[e];
+
+	entry->prev = NO_ENTRY;
+	entry->next = cache.head;
+	if (cache.head != NO_ENTRY)
+		cache.entries[cache.head].prev = e;
+	cache.head = e;
+	if (cache.tail == NO_ENTRY)
+		cache.tail = e;
+}
+
+static void lru_push_back(int e)
+{
+	struct cache_entry *entry = &cache.entries[e];
+
+	entry->next = NO_ENTRY;
+	entry->prev = cache.tail;
+	if (cache.tail != NO_ENTRY)
+		cache.entries[cache.tail].next = e;
+	cache.tail = e;
+	if (cache.head == NO_ENTRY)
+		cache.head = e;
+}
+
+static void hash_remove(int e)
+{
+	int *link = &cache.buckets[bucket_of(cache.entries[e].block)];
+
+	while (*link != e)
+		link = &cache.entries[*link].hnext;
+	*link = cache.entries[e].hnext;
+}
+
+static int lookup(size_t block)
+{
+	int e = cache.buckets[bucket_of(block)];
+
+	while (e != NO_ENTRY && cache.entries[e].block != block)
+		e = cache.entries[e].hnext;
+
+	return e;
+}
+
+/* drops entry @e from the cache */
+static void drop(int e)
+{
+	hash_remove(e);
+	cache.entries[e].valid = false;
+	lru_unlink(e);
+	lru_push_back(e);
+}
+
+/* wait for the prefetches in flight; the blocks that could not be read are
+ * dropped from the cache */
+static void settle(void)
+{
+	size_t i;
+	int e;
+
+	if (!cache.nloading)
+		return;
+
+	/* prefetches may have been submitted by another thread */
+	block_aio_drain();
+
+	for (i = 0; i < cache.nloading; i++) {
+		e = cache.loading[i];
+		cache.entries[e].loading = false;
+		if (cache.entries[e].load_failed)
+			drop(e);
+	}
+	cache.nloading = 0;
+}
+
+/* write entry back to disk if needed */
+static int clean(int e)
+{
+	struct cache_entry *entry = &cache.entries[e];
+
+	if (entry->valid && entry->dirty) {
+		if (block_write(entry->block, entry_data(e)))
+			return -1;
+		entry->dirty = false;
+	}
+
+	return 0;
+}
+
+/* take the least recently used entry over for @block */
+static int evict(size_t block)
+{
+	int e = cache.tail;
+	struct cache_entry *entry = &cache.entries[e];
+
+	if (clean(e))
+		return NO_ENTRY;
+
+	if (entry->valid)
+		hash_remove(e);
+
+	entry->block = block;
+	entry->valid = true;
+	entry->hnext = cache.buckets[bucket_of(block)];
+	cache.buckets[bucket_of(block)] = e;
+
+	lru_unlink(e);
+	lru_push_front(e);
+
+	return e;
+}
+
+int cache_open(size_t nblocks)
+{
+	size_t i, nbuckets = 1;
+
+	if (cache.open) {
+		cache_error("cache already open");
+		return -1;
+	}
+
+	cache.count = nblocks;
+	cache.entries = NULL;
+	cache.data = NULL;
+	cache.buckets = NULL;
+	cache.loading = NULL;
+	cache.nloading = 0;
+	cache.flushing = NULL;
+	cache.head = cache.tail = NO_ENTRY;
+
+	if (nblocks) {
+		while (nbuckets < 2 * nblocks)
+			nbuckets <<= 1;
+
+		cache.entries = calloc(nblocks, sizeof(*cache.entries));
+		cache.data = malloc(nblocks * BLOCK_SIZE);
+		cache.buckets = malloc(nbuckets * sizeof(*cache.buckets));
+		cache.loading = malloc(nblocks * sizeof(*cache.loading));
+		cache.flushing = malloc(nblocks * sizeof(*cache.flushing));
+		if (!cache.entries || !cache.data || !cache.buckets ||
+		    !cache.loading || !cache.flushing) {
+			cache_error("cannot allocate %zu blocks", nblocks);
+			free(cache.entries);
+			free(cache.data);
+			free(cache.buckets);
+			free(cache.loading);
+			free(cache.flushing);
+			cache.count = 0;
+			return -1;
+		}
+		cache.bucket_mask = nbuckets - 1;
+
+		for (i = 0; i < nbuckets; i++)
+			cache.buckets[i] = NO_ENTRY;
+		for (i = 0; i < nblocks; i++)
+			lru_push_front(i);
+	}
+
+	cache.open = true;
+
+	return 0;
+}
+
+int cache_close(void)
+{
+	int ret;
+
+	if (!cache.open) {
+		cache_error("no cache currently open");
+		return -1;
+	}
+
+	ret = cache_flush();
+
+	free(cache.entries);
+	free(cache.data);
+	free(cache.buckets);
+	free(cache.loading);
+	free(cache.flushing);
+	cache.count = 0;
+	cache.open = false;
+
+	return ret;
+}
+
+/* returns the entry holding @block, read from the disk if it was not cached,
+ * or NO_ENTRY if it cannot be read */
+static int fetch(size_t block)
+{
+	int e = lookup(block);
+
+	if (e != NO_ENTRY) {
+		lru_unlink(e);
+		lru_push_front(e);
+		return e;
+	}
+
+	e = evict(block);
+	if (e == NO_ENTRY)
+		return NO_ENTRY;
+	if (block_read(block, entry_data(e))) {
+		/* leave the entry empty rather than holding garbage */
+		drop(e);
+		return NO_ENTRY;
+	}
+
+	return e;
+}
+
+/* copies @block into @buf, the cache being locked */
+static int read_locked(size_t block, void *buf)
+{
+	int e;
+
+	settle();
+	e = fetch(block);
+	if (e == NO_ENTRY)
+		return -1;
+	memcpy(buf, entry_data(e), BLOCK_SIZE);
+
+	return 0;
+}
+
+int cache_read(size_t block, void *buf)
+{
+	int ret;
+
+	if (!cache.count)
+		return block_read(block, buf);
+
+	pthread_mutex_lock(&cache.lock);
+	ret = read_locked(block, buf);
+	pthread_mutex_unlock(&cache.lock);
+
+	return ret;
+}
+
+/* copies @buf into the entry of @block, the cache being locked */
+static int write_locked(size_t block, const void *buf)
+{
+	int e;
+
+	settle();
+	e = lookup(block);
+	if (e == NO_ENTRY) {
+		e = evict(block);
+		if (e == NO_ENTRY)
+			return -1;
+	} else {
+		lru_unlink(e);
+		lru_push_front(e);
+	}
+
+	memcpy(entry_data(e), buf, BLOCK_SIZE);
+	cache.entries[e].dirty = true;
+
+	return 0;
+}
+
+int cache_write(size_t block, const void *buf)
+{
+	int ret;
+
+	if (!cache.count)
+		return block_write(block, buf);
+
+	pthread_mutex_lock(&cache.lock);
+	ret = write_locked(block, buf);
+	pthread_mutex_unlock(&cache.lock);
+
+	return ret;
+}
+
+int cache_read_part(size_t block, size_t offset, size_t len, void *buf)
+{
+	uint8_t bounce[BLOCK_SIZE];
+	const uint8_t *src;
+	int e, ret = 0;
+
+	if (cache.count) {
+		pthread_mutex_lock(&cache.lock);
+		settle();
+		e = lookup(block);
+		if (e != NO_ENTRY || !block_ptr(block)) {
+			/* copy straight from the cached block */
+			e = fetch(block);
+			if (e == NO_ENTRY)
+				ret = -1;
+			else
+				memcpy(buf, entry_data(e) + offset, len);
+			pthread_mutex_unlock(&cache.lock);
+			return ret;
+		}
+		pthread_mutex_unlock(&cache.lock);
+	}
+
+	/* mapped blocks are not worth caching */
+	src = block_ptr(block);
+	if (!src) {
+		if (block_read(block, bounce))
+			return -1;
+		src = bounce;
+	}
+	memcpy(buf, src + offset, len);
+
+	return 0;
+}
+
+/* drops the cached copies of blocks @block to @block + @count - 1, whose
+ * content on disk is unknown after a failed write */
+static void drop_range(size_t block, size_t count)
+{
+	size_t i;
+	int e;
+
+	pthread_mutex_lock(&cache.lock);
+	settle();
+	for (i = 0; i < count; i++) {
+		e = lookup(block + i);
+		if (e != NO_ENTRY)
+			drop(e);
+	}
+	pthread_mutex_unlock(&cache.lock);
+}
+
+/* records an asynchronous write of the calling thread until it is waited for */
+static int track_write(size_t block, size_t count)
+{
+	struct write_req *grown;
+	size_t capacity;
+
+	if (nwrites == writes_capacity) {
+		capacity = writes_capacity ? 2 * writes_capacity : 16;
+		grown = realloc(writes, capacity * sizeof(*writes));
+		if (!grown)
+			return -1;
+		writes = grown;
+		writes_capacity = capacity;
+	}
+	writes[nwrites].block = block;
+	writes[nwrites].count = count;
+	nwrites++;
+
+	return 0;
+}
+
+/* reads the blocks missing from the cache synchronously, or submits them as
+ * asynchronous requests if @async */
+static int read_range(size_t block, size_t count, void *buf, bool async)
+{
+	struct block_vec vec[READV_MAX];
+	size_t i = 0, j, n = 0;
+	uint8_t *dst = buf;
+	int e;
+
+	if (!cache.count)
+		return async ? block_aio_read(block, count, buf) :
+			block_read_range(block, count, buf);
+
+	if (count == 1)
+		return cache_read(block, buf);
+
+	pthread_mutex_lock(&cache.lock);
+	settle();
+	while (i < count) {
+		e = lookup(block + i);
+		if (e != NO_ENTRY) {
+			memcpy(dst + i * BLOCK_SIZE, entry_data(e), BLOCK_SIZE);
+			lru_unlink(e);
+			lru_push_front(e);
+			i++;
+			continue;
+		}
+
+		/* the caller keeps the blocks from being written meanwhile, so
+		 * the cache can be left to other threads during the transfers */
+		for (j = i + 1; j < count && lookup(block + j) == NO_ENTRY; j++)
+			;
+		if (async) {
+			pthread_mutex_unlock(&cache.lock);
+			if (block_aio_read(block + i, j - i,
+					   dst + i * BLOCK_SIZE))
+				return -1;
+			pthread_mutex_lock(&cache.lock);
+			settle();
+			i = j;
+			continue;
+		}
+
+		/* the missing blocks are read together once gathered, runs of
+		 * them merged into single requests */
+		for (; i < j && n < READV_MAX; i++, n++) {
+			vec[n].block = block + i;
+			vec[n].buf = dst + i * BLOCK_SIZE;
+		}
+		if (n == READV_MAX) {
+			pthread_mutex_unlock(&cache.lock);
+			if (block_readv(vec, n))
+				return -1;
+			n = 0;
+			pthread_mutex_lock(&cache.lock);
+			settle();
+		}
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	return n ? block_readv(vec, n) : 0;
+}
+
+/* writes the blocks synchronously, or submits them as an asynchronous
+ * request if @async */
+static int write_range(size_t block, size_t count, const void *buf, bool async)
+{
+	size_t i;
+	const uint8_t *src = buf;
+	int e, ret;
+
+	if (count == 1)
+		return cache_write(block, buf);
+
+	/* update the cached copies first: as they are clean, an eviction
+	 * during the transfer cannot overwrite the new content with the old */
+	if (cache.count) {
+		pthread_mutex_lock(&cache.lock);
+		settle();
+		for (i = 0; i < count; i++) {
+			e = lookup(block + i);
+			if (e != NO_ENTRY) {
+				memcpy(entry_data(e), src + i * BLOCK_SIZE,
+				       BLOCK_SIZE);
+				cache.entries[e].dirty = false;
+			}
+		}
+		pthread_mutex_unlock(&cache.lock);
+	}
+
+	/* an asynchronous write only fails when waited for (see cache_wait());
+	 * one that cannot be tracked until then is written synchronously */
+	if (async && !cache.count)
+		return block_aio_write(block, count, buf);
+	if (async && !track_write(block, count)) {
+		ret = block_aio_write(block, count, buf);
+		/* a request never submitted is not waited for */
+		if (ret)
+			nwrites--;
+	} else {
+		ret = block_write_range(block, count, buf);
+	}
+
+	/* the disk may still hold the old content */
+	if (ret && cache.count)
+		drop_range(block, count);
+
+	return ret;
+}
+
+int cache_read_range(size_t block, size_t count, void *buf)
+{
+	return read_range(block, count, buf, false);
+}
+
+int cache_write_range(size_t block, size_t count, const void *buf)
+{
+	return write_range(block, count, buf, false);
+}
+
+int cache_submit_read_range(size_t block, size_t count, void *buf)
+{
+	return read_range(block, count, buf, true);
+}
+
+int cache_submit_write_range(size_t block, size_t count, const void *buf)
+{
+	return write_range(block, count, buf, true);
+}
+
+int cache_wait(void)
+{
+	size_t i;
+	int ret;
+
+	ret = block_aio_wait();
+	if (ret && cache.count) {
+		for (i = 0; i < nwrites; i++)
+			drop_range(writes[i].block, writes[i].count);
+	}
+
+	free(writes);
+	writes = NULL;
+	nwrites = 0;
+	writes_capacity = 0;
+
+	return ret;
+}
+
+int cache_prefetch(size_t block, size_t count)
+{
+	size_t i;
+	int e, ret = 0;
+
+	if (!cache.count || block_ptr(block))
+		return 0;
+
+	pthread_mutex_lock(&cache.lock);
+	for (i = 0; i < count; i++) {
+		if (lookup(block + i) != NO_ENTRY)
+			continue;
+
+		/* keep at least half of the cache for the blocks in use */
+		if (cache.nloading >= cache.count / 2 ||
+		    cache.entries[cache.tail].loading)
+			break;
+
+		e = evict(block + i);
+		if (e == NO_ENTRY) {
+			ret = -1;
+			break;
+		}
+		cache.entries[e].loading = true;
+		cache.entries[e].load_failed = false;
+		if (block_aio_prefetch(block + i, 1, entry_data(e),
+				       &cache.entries[e].load_failed)) {
+			cache.entries[e].loading = false;
+			drop(e);
+			ret = -1;
+			break;
+		}
+		cache.loading[cache.nloading++] = e;
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	return ret ? ret : block_aio_submit();
+}
+
+static int compare_vec(const void *a, const void *b)
+{
+	const struct block_vec *va = a, *vb = b;
+
+	return (va->block > vb->block) - (va->block < vb->block);
+}
+
+int cache_flush(void)
+{
+	size_t i, n = 0;
+	int ret = 0;
+
+	pthread_mutex_lock(&cache.lock);
+	settle();
+
+	/* write the dirty blocks back in disk order, so that the ones that
+	 * follow each other on disk go out as a single request */
+	for (i = 0; i < cache.count; i++) {
+		if (cache.entries[i].valid && cache.entries[i].dirty) {
+			cache.flushing[n].block = cache.entries[i].block;
+			cache.flushing[n].buf = entry_data(i);
+			n++;
+		}
+	}
+	if (n)
+		qsort(cache.flushing, n, sizeof(*cache.flushing), compare_vec);
+
+	if (block_writev(cache.flushing, n)) {
+		ret = -1;
+	} else {
+		for (i = 0; i < cache.count; i++)
+			cache.entries[i].dirty = false;
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	return ret;
+}
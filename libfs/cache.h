@@ -0,0 +1,174 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h> /* for size_t definition */
+
+/**
+ * cache_open - Set up the block cache
+ * @nblocks: Number of blocks the cache can hold
+ *
+ * Allocate a write-back cache of @nblocks blocks in front of the virtual disk.
+ * Once the cache is open, block accesses should go through cache_read() and
+ * cache_write() instead of block_read() and block_write(). A cache of 0 blocks
+ * is valid and simply forwards every access to the disk. Threads can access
+ * the cache concurrently, as long as they do not access the same blocks while
+ * some of them write these blocks.
+ *
+ * Return: -1 if the cache is already open or cannot be allocated. 0 otherwise.
+ */
+int cache_open(size_t nblocks);
+
+/**
+ * cache_close - Flush and release the block cache
+ *
+ * Write every dirty block back to the disk and release the cache memory.
+ *
+ * Return: -1 if the cache was not open or if a dirty block could not be
+ * written back. 0 otherwise.
+ */
+int cache_close(void);
+
+/**
+ * cache_read - Read a block through the cache
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Copy the content of block @block (%BLOCK_SIZE bytes) into buffer @buf, from
+ * the cache if the block is present, or from the disk otherwise. A block read
+ * from the disk is kept in the cache, evicting the least recently used block if
+ * the cache is full.
+ *
+ * Return: -1 if the block cannot be read from the disk, or if an evicted dirty
+ * block cannot be written back. 0 otherwise.
+ */
+int cache_read(size_t block, void *buf);
+
+/**
+ * cache_write - Write a block through the cache
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * Copy the content of buffer @buf (%BLOCK_SIZE bytes) into the cached copy of
+ * block @block and mark it dirty. The block only reaches the disk when it gets
+ * evicted or when the cache is flushed.
+ *
+ * Return: -1 if an evicted dirty block cannot be written back. 0 otherwise.
+ */
+int cache_write(size_t block, const void *buf);
+
+/**
+ * cache_read_part - Read part of a block through the cache
+ * @block: Index of the block to read from
+ * @offset: Offset of the first byte to read in the block
+ * @len: Number of bytes to read
+ * @buf: Data buffer to be filled with the bytes
+ *
+ * Copy @len bytes of block @block, from offset @offset, into buffer @buf
+ * without going through an intermediate block-sized buffer: straight from the
+ * cached copy, or from the disk mapping if the disk was opened with
+ * %BLOCK_DISK_MMAP and the block is not cached. Other blocks are read into the
+ * cache first.
+ *
+ * Return: -1 if the block cannot be read, or if an evicted dirty block cannot
+ * be written back. 0 otherwise.
+ */
+int cache_read_part(size_t block, size_t offset, size_t len, void *buf);
+
+/**
+ * cache_read_range - Read contiguous blocks through the cache
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Copy the content of blocks @block to @block + @count - 1 into buffer @buf.
+ * Blocks present in the cache are copied from it, and each run of missing
+ * blocks is read from the disk with a single request. Blocks read as part of a
+ * multi-block range are not inserted in the cache, so that bulk transfers do
+ * not evict the hot blocks.
+ *
+ * Return: -1 if the blocks cannot be read. 0 otherwise.
+ */
+int cache_read_range(size_t block, size_t count, void *buf);
+
+/**
+ * cache_write_range - Write contiguous blocks through the cache
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write buffer @buf in blocks @block to @block + @count - 1. A multi-block
+ * range is written straight to the disk with a single request and any cached
+ * copy of its blocks is refreshed. A single block is handled like
+ * cache_write().
+ *
+ * Return: -1 if the blocks cannot be written. 0 otherwise.
+ */
+int cache_write_range(size_t block, size_t count, const void *buf);
+
+/**
+ * cache_submit_read_range - Submit a read of contiguous blocks through the cache
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Same as cache_read_range(), except that the blocks missing from the cache are
+ * read with block_aio_read(): @buf is only filled once cache_wait() has
+ * returned.
+ *
+ * Return: -1 if the blocks cannot be read. 0 otherwise.
+ */
+int cache_submit_read_range(size_t block, size_t count, void *buf);
+
+/**
+ * cache_submit_write_range - Submit a write of contiguous blocks through the
+ * cache
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Same as cache_write_range(), except that a multi-block range is written with
+ * block_aio_write(): @buf must stay untouched, and the blocks are only on disk,
+ * once cache_wait() has returned.
+ *
+ * Return: -1 if the blocks cannot be written. 0 otherwise.
+ */
+int cache_submit_write_range(size_t block, size_t count, const void *buf);
+
+/**
+ * cache_wait - Wait for the submitted reads and writes
+ *
+ * Same as block_aio_wait(), except that if a request of the calling thread
+ * failed, the cached copies of the blocks of its writes submitted since the
+ * last wait are dropped: the disk may not hold their new content.
+ *
+ * Return: -1 if a request of the calling thread failed. 0 otherwise.
+ */
+int cache_wait(void);
+
+/**
+ * cache_prefetch - Start reading blocks into the cache
+ * @block: Index of the first block to prefetch
+ * @count: Number of blocks to prefetch
+ *
+ * Start reading the blocks @block to @block + @count - 1 that are not cached
+ * yet into the cache, with block_aio_read(), and return without waiting for
+ * them. The next cache operation waits for the prefetches in flight. At most
+ * half of the cache is filled by prefetches at any time, and nothing is
+ * prefetched if the cache has no blocks or if the disk is mapped.
+ *
+ * Return: -1 if a prefetch cannot be started. 0 otherwise.
+ */
+int cache_prefetch(size_t block, size_t count);
+
+/**
+ * cache_flush - Write back dirty blocks
+ *
+ * Write every dirty block of the cache back to the disk, in disk order, so that
+ * dirty blocks that follow each other on disk are written by a single
+ * request. Blocks stay cached.
+ *
+ * Return: -1 if a dirty block could not be written back. 0 otherwise.
+ */
+int cache_flush(void);
+
+#endif /* _CACHE_H */
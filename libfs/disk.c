@@ -1,11 +1,24 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+/* linux/fs.h, pulled in by linux/io_uring.h, has its own idea of a block */
+#undef BLOCK_SIZE
+
 #include "disk.h"
+#include "trace.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
@@ -13,20 +26,97 @@
 /* Invalid file descriptor */
 #define INVALID_FD -1
 
+/* Maximum number of buffers merged into a single vectored request */
+#define DISK_IOV_MAX 256
+
 /* Disk instance description */
 struct disk {
 	/* File descriptor */
 	int fd;
 	/* Block count */
 	size_t bcount;
+	/* Mapping of the disk image (NULL if not mapped) */
+	char *map;
 };
 
 /* Currently open virtual disk (invalid by default) */
 static struct disk disk = { .fd = INVALID_FD };
 
+/* Asynchronous request in flight */
+struct aio_request {
+	bool write;
+	off_t pos;
+	char *buf;
+	size_t len;
+	/* Flag set if the request fails */
+	bool *failed;
+};
+
+/* Asynchronous I/O engine description */
+struct aio {
+	/* Serializes the use of the rings and of the request slots */
+	pthread_mutex_t lock;
+	/* Engine is set up */
+	bool open;
+	/* io_uring instance, or INVALID_FD for synchronous fallback */
+	int fd;
+	/* Queue depth, and number of requests submitted to the kernel and
+	 * queued but not submitted yet */
+	unsigned int depth;
+	unsigned int inflight;
+	unsigned int queued;
+	/* Submission queue ring */
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	/* Completion queue ring */
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* Ring mappings */
+	void *sq_map, *cq_map;
+	size_t sq_map_len, cq_map_len, sqes_len;
+	/* Requests indexed by their slot, and stack of free slots */
+	struct aio_request *requests;
+	unsigned int *free_slots;
+	unsigned int nfree;
+};
+
+static struct aio aio = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = INVALID_FD,
+};
+
+/* A request submitted by the calling thread since its last wait failed */
+static __thread bool aio_failed;
+
+/* Access counters */
+static struct block_stats stats;
+
+/* count a request of @count blocks */
+static void count_request(bool write, size_t count)
+{
+	if (write) {
+		__atomic_fetch_add(&stats.writes, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&stats.bytes_written, count * BLOCK_SIZE,
+				   __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&stats.reads, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&stats.bytes_read, count * BLOCK_SIZE,
+				   __ATOMIC_RELAXED);
+	}
+}
+
+static int block_io(bool write, off_t pos, struct iovec *iov, int iovcnt);
+static int block_check_range(size_t block, size_t count);
+
 int block_disk_open(const char *diskname)
+{
+	return block_disk_open_flags(diskname, 0);
+}
+
+int block_disk_open_flags(const char *diskname, int flags)
 {
 	int fd;
+	void *map = NULL;
 	struct stat st;
 
 	if (!diskname) {
@@ -46,6 +136,7 @@ int block_disk_open(const char *diskname)
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
+		close(fd);
 		return -1;
 	}
 
@@ -53,11 +144,23 @@ int block_disk_open(const char *diskname)
 	if (st.st_size % BLOCK_SIZE != 0) {
 		block_error("size '%zu' is not multiple of '%d'",
 			    st.st_size, BLOCK_SIZE);
+		close(fd);
 		return -1;
 	}
 
+	if (flags & BLOCK_DISK_MMAP) {
+		map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			   fd, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap");
+			close(fd);
+			return -1;
+		}
+	}
+
 	disk.fd = fd;
 	disk.bcount = st.st_size / BLOCK_SIZE;
+	disk.map = map;
 
 	return 0;
 }
@@ -69,6 +172,14 @@ int block_disk_close(void)
 		return -1;
 	}
 
+	if (aio.open)
+		block_aio_close();
+
+	if (disk.map) {
+		munmap(disk.map, disk.bcount * BLOCK_SIZE);
+		disk.map = NULL;
+	}
+
 	close(disk.fd);
 
 	disk.fd = INVALID_FD;
@@ -86,8 +197,41 @@ int block_disk_count(void)
 	return disk.bcount;
 }
 
-int block_write(size_t block, const void *buf)
+const void *block_ptr(size_t block)
+{
+	if (!disk.map || block >= disk.bcount)
+		return NULL;
+
+	return disk.map + block * BLOCK_SIZE;
+}
+
+int block_disk_sync(void)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (disk.map && msync(disk.map, disk.bcount * BLOCK_SIZE, MS_SYNC)) {
+		perror("msync");
+		return -1;
+	}
+
+	if (fdatasync(disk.fd)) {
+		perror("fdatasync");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int write_block(size_t block, const void *buf)
 {
+	struct iovec iov = {
+		.iov_base = (void *)buf,
+		.iov_len = BLOCK_SIZE,
+	};
+
 	if (disk.fd == INVALID_FD) {
 		block_error("no disk currently open");
 		return -1;
@@ -99,46 +243,601 @@ int block_write(size_t block, const void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	count_request(true, 1);
+
+	/* Positional write, so that threads do not share a file offset */
+	return block_io(true, block * BLOCK_SIZE, &iov, 1);
+}
+
+static int read_block(size_t block, void *buf)
+{
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = BLOCK_SIZE,
+	};
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	if (block >= disk.bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block, disk.bcount);
 		return -1;
 	}
 
-	return 0;
+	count_request(false, 1);
+
+	/* Positional read, so that threads do not share a file offset */
+	return block_io(false, block * BLOCK_SIZE, &iov, 1);
+}
+
+/* records the beginning of block operation @type on @count blocks from @block */
+static struct trace_event *trace_disk(enum trace_type type, size_t block,
+				      size_t count)
+{
+	struct trace_event *ev = trace_begin(type);
+
+	if (ev) {
+		ev->block = block;
+		ev->count = count;
+	}
+
+	return ev;
+}
+
+int block_write(size_t block, const void *buf)
+{
+	struct trace_event *ev = trace_disk(TRACE_BLOCK_WRITE, block, 1);
+	int ret;
+
+	ret = write_block(block, buf);
+	trace_end(ev, ret);
+
+	return ret;
 }
 
 int block_read(size_t block, void *buf)
+{
+	struct trace_event *ev = trace_disk(TRACE_BLOCK_READ, block, 1);
+	int ret;
+
+	ret = read_block(block, buf);
+	trace_end(ev, ret);
+
+	return ret;
+}
+
+
+/* transfer @iovcnt buffers to/from the disk starting at byte @pos */
+static int block_io(bool write, off_t pos, struct iovec *iov, int iovcnt)
+{
+	ssize_t ret;
+	int i;
+
+	/* mapped disk: plain memory copies */
+	if (disk.map) {
+		for (i = 0; i < iovcnt; i++) {
+			if (write)
+				memcpy(disk.map + pos, iov[i].iov_base,
+				       iov[i].iov_len);
+			else
+				memcpy(iov[i].iov_base, disk.map + pos,
+				       iov[i].iov_len);
+			pos += iov[i].iov_len;
+		}
+		return 0;
+	}
+
+	while (iovcnt) {
+		if (write)
+			ret = pwritev(disk.fd, iov, iovcnt, pos);
+		else
+			ret = preadv(disk.fd, iov, iovcnt, pos);
+		if (ret < 0) {
+			perror(write ? "pwritev" : "preadv");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("unexpected end of disk at %lld", (long long)pos);
+			return -1;
+		}
+		pos += ret;
+
+		/* skip what has been transferred, in case of a short transfer */
+		while (iovcnt && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+static int block_check_range(size_t block, size_t count)
 {
 	if (disk.fd == INVALID_FD) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	if (block >= disk.bcount || count > disk.bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
+		return -1;
+	}
+
+	return 0;
+}
+
+int block_write_range(size_t block, size_t count, const void *buf)
+{
+	struct iovec iov = {
+		.iov_base = (void *)buf,
+		.iov_len = count * BLOCK_SIZE,
+	};
+	struct trace_event *ev;
+	int ret;
+
+	if (block_check_range(block, count))
+		return -1;
+
+	count_request(true, count);
+	ev = trace_disk(TRACE_BLOCK_WRITE, block, count);
+	ret = block_io(true, block * BLOCK_SIZE, &iov, 1);
+	trace_end(ev, ret);
+
+	return ret;
+}
+
+int block_read_range(size_t block, size_t count, void *buf)
+{
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = count * BLOCK_SIZE,
+	};
+	struct trace_event *ev;
+	int ret;
+
+	if (block_check_range(block, count))
+		return -1;
+
+	count_request(false, count);
+	ev = trace_disk(TRACE_BLOCK_READ, block, count);
+	ret = block_io(false, block * BLOCK_SIZE, &iov, 1);
+	trace_end(ev, ret);
+
+	return ret;
+}
+
+/* merge runs of consecutive blocks of @vec into vectored requests */
+static int block_vec_io(bool write, const struct block_vec *vec, size_t count)
+{
+	struct iovec iov[DISK_IOV_MAX];
+	struct trace_event *ev;
+	size_t i = 0, n;
+	int ret;
+
+	while (i < count) {
+		if (block_check_range(vec[i].block, 1))
+			return -1;
+
+		iov[0].iov_base = vec[i].buf;
+		iov[0].iov_len = BLOCK_SIZE;
+		n = 1;
+		while (i + n < count && n < DISK_IOV_MAX &&
+		       vec[i + n].block == vec[i].block + n) {
+			if (block_check_range(vec[i + n].block, 1))
+				return -1;
+			iov[n].iov_base = vec[i + n].buf;
+			iov[n].iov_len = BLOCK_SIZE;
+			n++;
+		}
+
+		count_request(write, n);
+		ev = trace_disk(write ? TRACE_BLOCK_WRITE : TRACE_BLOCK_READ,
+				vec[i].block, n);
+		ret = block_io(write, vec[i].block * BLOCK_SIZE, iov, n);
+		trace_end(ev, ret);
+		if (ret)
+			return -1;
+		i += n;
+	}
+
+	return 0;
+}
+
+int block_writev(const struct block_vec *vec, size_t count)
+{
+	return block_vec_io(true, vec, count);
+}
+
+int block_readv(const struct block_vec *vec, size_t count)
+{
+	return block_vec_io(false, vec, count);
+}
+
+static int ring_setup(unsigned int depth)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, depth, &p);
+	if (fd < 0)
+		return -1;
+
+	aio.sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	aio.cq_map_len = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (aio.cq_map_len > aio.sq_map_len)
+			aio.sq_map_len = aio.cq_map_len;
+		aio.cq_map_len = aio.sq_map_len;
+	}
+
+	aio.sq_map = mmap(NULL, aio.sq_map_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (aio.sq_map == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		aio.cq_map = aio.sq_map;
+	} else {
+		aio.cq_map = mmap(NULL, aio.cq_map_len, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, fd,
+				  IORING_OFF_CQ_RING);
+		if (aio.cq_map == MAP_FAILED) {
+			munmap(aio.sq_map, aio.sq_map_len);
+			close(fd);
+			return -1;
+		}
+	}
+
+	aio.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	aio.sqes = mmap(NULL, aio.sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (aio.sqes == MAP_FAILED) {
+		if (aio.cq_map != aio.sq_map)
+			munmap(aio.cq_map, aio.cq_map_len);
+		munmap(aio.sq_map, aio.sq_map_len);
+		close(fd);
+		return -1;
+	}
+
+	sq = aio.sq_map;
+	aio.sq_head = (unsigned int *)(sq + p.sq_off.head);
+	aio.sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	aio.sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	aio.sq_array = (unsigned int *)(sq + p.sq_off.array);
+	cq = aio.cq_map;
+	aio.cq_head = (unsigned int *)(cq + p.cq_off.head);
+	aio.cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	aio.cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	aio.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	aio.fd = fd;
+
+	return 0;
+}
+
+static void ring_teardown(void)
+{
+	munmap(aio.sqes, aio.sqes_len);
+	if (aio.cq_map != aio.sq_map)
+		munmap(aio.cq_map, aio.cq_map_len);
+	munmap(aio.sq_map, aio.sq_map_len);
+	close(aio.fd);
+	aio.fd = INVALID_FD;
+}
+
+/* hand the queued requests to the kernel, and wait for at least
+ * @min_complete completions */
+static int ring_enter(unsigned int min_complete)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, aio.fd, aio.queued,
+			      min_complete, min_complete ?
+			      IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		perror("io_uring_enter");
+		return -1;
+	}
+
+	aio.inflight += ret;
+	aio.queued -= ret;
+
+	return 0;
+}
+
+/* finish request @slot, which transferred @res bytes or failed with -@res */
+static void complete_request(unsigned int slot, int res)
+{
+	struct aio_request *req = &aio.requests[slot];
+	struct iovec iov;
+
+	if (res < 0 && res != -EINVAL && res != -EOPNOTSUPP) {
+		errno = -res;
+		perror(req->write ? "io_uring write" : "io_uring read");
+		*req->failed = true;
+	} else {
+		/* complete short transfers, and requests that the kernel does
+		 * not support, synchronously */
+		if (res < 0)
+			res = 0;
+		if ((size_t)res < req->len) {
+			iov.iov_base = req->buf + res;
+			iov.iov_len = req->len - res;
+			if (block_io(req->write, req->pos + res, &iov, 1))
+				*req->failed = true;
+		}
+	}
+
+	aio.free_slots[aio.nfree++] = slot;
+}
+
+/* process every available completion */
+static void ring_reap(void)
+{
+	unsigned int head, tail;
+	struct io_uring_cqe *cqe;
+
+	head = *aio.cq_head;
+	tail = __atomic_load_n(aio.cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		cqe = &aio.cqes[head & *aio.cq_mask];
+		complete_request(cqe->user_data, cqe->res);
+		aio.inflight--;
+		head++;
+	}
+	__atomic_store_n(aio.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* queue a transfer of @len bytes at disk position @pos, whose failure sets
+ * flag @failed */
+static int aio_submit(bool write, off_t pos, void *buf, size_t len,
+		      bool *failed)
+{
+	struct io_uring_sqe *sqe;
+	struct iovec iov;
+	unsigned int slot, tail, index;
+
+	/* synchronous fallback: the transfer is done right away */
+	if (aio.fd == INVALID_FD || disk.map) {
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		if (block_io(write, pos, &iov, 1))
+			*failed = true;
+		return 0;
+	}
+
+	/* queue is full: wait for a request to complete */
+	while (aio.nfree == 0) {
+		if (ring_enter(1))
+			return -1;
+		ring_reap();
+	}
+
+	slot = aio.free_slots[--aio.nfree];
+	aio.requests[slot].write = write;
+	aio.requests[slot].pos = pos;
+	aio.requests[slot].buf = buf;
+	aio.requests[slot].len = len;
+	aio.requests[slot].failed = failed;
+
+	tail = *aio.sq_tail;
+	index = tail & *aio.sq_mask;
+	sqe = &aio.sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = disk.fd;
+	sqe->off = pos;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->user_data = slot;
+	aio.sq_array[index] = index;
+	__atomic_store_n(aio.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	aio.queued++;
+
+	return 0;
+}
+
+int block_aio_open(unsigned int depth)
+{
+	unsigned int slot;
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (aio.open) {
+		block_error("asynchronous I/O already set up");
 		return -1;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	if (depth == 0)
+		depth = BLOCK_AIO_DEPTH;
+
+	aio.requests = calloc(depth, sizeof(*aio.requests));
+	aio.free_slots = malloc(depth * sizeof(*aio.free_slots));
+	if (!aio.requests || !aio.free_slots) {
+		block_error("cannot allocate %u requests", depth);
+		free(aio.requests);
+		free(aio.free_slots);
 		return -1;
 	}
+	for (slot = 0; slot < depth; slot++)
+		aio.free_slots[slot] = slot;
+	aio.nfree = depth;
+	aio.depth = depth;
+	aio.inflight = 0;
+	aio.queued = 0;
+
+	/* without io_uring, requests are served synchronously */
+	if (ring_setup(depth))
+		aio.fd = INVALID_FD;
+
+	aio.open = true;
 
 	return 0;
 }
 
+int block_aio_close(void)
+{
+	int ret;
+
+	if (!aio.open) {
+		block_error("asynchronous I/O not set up");
+		return -1;
+	}
+
+	ret = block_aio_wait();
+
+	if (aio.fd != INVALID_FD)
+		ring_teardown();
+	free(aio.requests);
+	free(aio.free_slots);
+	aio.open = false;
+
+	return ret;
+}
+
+/* queue a transfer of @count blocks from @block, whose failure sets flag
+ * @failed */
+static int aio_transfer(enum trace_type type, bool write, size_t block,
+			size_t count, void *buf, bool *failed)
+{
+	struct trace_event *ev;
+	int ret;
+
+	count_request(write, count);
+	ev = trace_disk(type, block, count);
+	pthread_mutex_lock(&aio.lock);
+	ret = aio_submit(write, block * BLOCK_SIZE, buf, count * BLOCK_SIZE,
+			 failed);
+	pthread_mutex_unlock(&aio.lock);
+	trace_end(ev, ret);
+
+	return ret;
+}
+
+int block_aio_read(size_t block, size_t count, void *buf)
+{
+	if (block_check_range(block, count))
+		return -1;
+
+	if (!aio.open)
+		return block_read_range(block, count, buf);
+
+	return aio_transfer(TRACE_BLOCK_AIO_READ, false, block, count, buf,
+			    &aio_failed);
+}
+
+int block_aio_write(size_t block, size_t count, const void *buf)
+{
+	if (block_check_range(block, count))
+		return -1;
+
+	if (!aio.open)
+		return block_write_range(block, count, buf);
+
+	return aio_transfer(TRACE_BLOCK_AIO_WRITE, true, block, count,
+			    (void *)buf, &aio_failed);
+}
+
+int block_aio_prefetch(size_t block, size_t count, void *buf, bool *failed)
+{
+	if (block_check_range(block, count))
+		return -1;
+
+	if (!aio.open) {
+		if (block_read_range(block, count, buf))
+			*failed = true;
+		return 0;
+	}
+
+	return aio_transfer(TRACE_BLOCK_AIO_READ, false, block, count, buf,
+			    failed);
+}
+
+int block_aio_submit(void)
+{
+	int ret = 0;
+
+	if (!aio.open)
+		return 0;
+
+	pthread_mutex_lock(&aio.lock);
+	if (aio.fd != INVALID_FD && aio.queued)
+		ret = ring_enter(0);
+	pthread_mutex_unlock(&aio.lock);
+
+	return ret;
+}
+
+int block_aio_drain(void)
+{
+	struct trace_event *ev = NULL;
+	int ret = 0;
+
+	if (!aio.open)
+		return 0;
+
+	pthread_mutex_lock(&aio.lock);
+	/* only waits that have something to wait for are traced */
+	if (aio.queued || aio.inflight)
+		ev = trace_disk(TRACE_BLOCK_AIO_WAIT, 0,
+				aio.queued + aio.inflight);
+	while (aio.fd != INVALID_FD && (aio.queued || aio.inflight)) {
+		if (ring_enter(aio.queued + aio.inflight)) {
+			ret = -1;
+			break;
+		}
+		ring_reap();
+	}
+	pthread_mutex_unlock(&aio.lock);
+	trace_end(ev, ret);
+
+	return ret;
+}
+
+int block_aio_wait(void)
+{
+	int ret;
+
+	/* requests of every thread get reaped, but each thread only hears
+	 * about the failure of its own */
+	ret = block_aio_drain();
+	if (aio_failed)
+		ret = -1;
+	aio_failed = false;
+
+	return ret;
+}
+
+void block_get_stats(struct block_stats *st)
+{
+	st->reads = __atomic_load_n(&stats.reads, __ATOMIC_RELAXED);
+	st->writes = __atomic_load_n(&stats.writes, __ATOMIC_RELAXED);
+	st->bytes_read = __atomic_load_n(&stats.bytes_read, __ATOMIC_RELAXED);
+	st->bytes_written = __atomic_load_n(&stats.bytes_written,
+					    __ATOMIC_RELAXED);
+}
+
+void block_reset_stats(void)
+{
+	memset(&stats, 0, sizeof(stats));
+}
@@ -1,24 +1,47 @@
 #ifndef _DISK_H
 #define _DISK_H
 
+#include <stdbool.h>
 #include <stddef.h> /* for size_t definition */
 
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/** block_disk_open_flags() flag: map the whole disk image in memory */
+#define BLOCK_DISK_MMAP 0x1
+
+/** Default depth of the asynchronous request queue */
+#define BLOCK_AIO_DEPTH 64
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
  *
  * Open virtual disk file @diskname. A virtual disk file must be opened before
  * blocks can be read from it with block_read() or written to it with
- * block_write().
+ * block_write(). Transfers do not share a file offset, so that several
+ * threads can read and write blocks concurrently.
  *
  * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
  * or is already open. 0 otherwise.
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_flags - Open virtual disk file with flags
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise OR of BLOCK_DISK_* flags
+ *
+ * Same as block_disk_open(), with some extra behaviour selected by @flags. With
+ * %BLOCK_DISK_MMAP, the whole disk image is mapped in memory: block transfers
+ * become plain memory copies and block_ptr() gives direct access to the
+ * content of the blocks.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or mapped, or is already open. 0 otherwise.
+ */
+int block_disk_open_flags(const char *diskname, int flags);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -34,6 +57,28 @@ int block_disk_close(void);
  */
 int block_disk_count(void);
 
+/**
+ * block_ptr - Get direct access to a block
+ * @block: Index of the block
+ *
+ * Return: NULL if the disk was not opened with %BLOCK_DISK_MMAP or if @block is
+ * out of bounds. Otherwise, a pointer to the %BLOCK_SIZE bytes of block @block
+ * in the mapping of the disk image, valid until the disk is closed.
+ */
+const void *block_ptr(size_t block);
+
+/**
+ * block_disk_sync - Make previous writes durable
+ *
+ * Wait until every block written so far, through the mapping of the disk image
+ * as well as through its file, has reached the underlying storage. Writes
+ * issued afterwards can thus never reach it first.
+ *
+ * Return: -1 if there was no virtual disk file opened or if the flush fails. 0
+ * otherwise.
+ */
+int block_disk_sync(void);
+
 /**
  * block_write - Write a block to disk
  * @block: Index of the block to write to
@@ -60,5 +105,206 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_range - Write contiguous blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf (@count * %BLOCK_SIZE bytes) in the virtual
+ * disk's blocks @block to @block + @count - 1, with a single request.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible or if the
+ * writing operation fails. 0 otherwise.
+ */
+int block_write_range(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_range - Read contiguous blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1
+ * (@count * %BLOCK_SIZE bytes) into buffer @buf, with a single request.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if the
+ * reading operation fails. 0 otherwise.
+ */
+int block_read_range(size_t block, size_t count, void *buf);
+
+/**
+ * struct block_vec - Block transfer descriptor
+ * @block: Index of the block
+ * @buf: Buffer of %BLOCK_SIZE bytes holding or receiving the block's content
+ */
+struct block_vec {
+	size_t block;
+	void *buf;
+};
+
+/**
+ * block_writev - Write scattered blocks to disk
+ * @vec: Array of block transfers
+ * @count: Number of entries in @vec
+ *
+ * Write each buffer of @vec in its block. Entries whose blocks follow each
+ * other on disk are merged into a single request, so callers should sort @vec
+ * by block index to get the most out of it.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible or if a
+ * writing operation fails. 0 otherwise.
+ */
+int block_writev(const struct block_vec *vec, size_t count);
+
+/**
+ * block_readv - Read scattered blocks from disk
+ * @vec: Array of block transfers
+ * @count: Number of entries in @vec
+ *
+ * Read each block of @vec into its buffer. Entries whose blocks follow each
+ * other on disk are merged into a single request.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if a
+ * reading operation fails. 0 otherwise.
+ */
+int block_readv(const struct block_vec *vec, size_t count);
+
+/**
+ * block_aio_open - Set up asynchronous block I/O
+ * @depth: Maximum number of requests in flight (0 selects %BLOCK_AIO_DEPTH)
+ *
+ * Set up an io_uring instance for the open virtual disk, so that the transfers
+ * requested with block_aio_read() and block_aio_write() are handed to the
+ * kernel together and served concurrently. If io_uring is not available, or if
+ * the disk is mapped in memory, requests are served synchronously instead. The
+ * engine is torn down by block_disk_close().
+ *
+ * Return: -1 if there was no virtual disk file opened, if asynchronous I/O is
+ * already set up, or if it cannot be allocated. 0 otherwise.
+ */
+int block_aio_open(unsigned int depth);
+
+/**
+ * block_aio_close - Tear down asynchronous block I/O
+ *
+ * Wait for the requests in flight, and release the io_uring instance.
+ *
+ * Return: -1 if asynchronous I/O was not set up, or if a request failed. 0
+ * otherwise.
+ */
+int block_aio_close(void);
+
+/**
+ * block_aio_read - Submit a read of contiguous blocks
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Queue the reading of blocks @block to @block + @count - 1 into buffer @buf.
+ * The content of @buf is only valid once block_aio_wait() has returned. If
+ * asynchronous I/O is not set up, the blocks are read right away.
+ *
+ * Return: -1 if any of the blocks is out of bounds or if the request cannot be
+ * queued. 0 otherwise.
+ */
+int block_aio_read(size_t block, size_t count, void *buf);
+
+/**
+ * block_aio_write - Submit a write of contiguous blocks
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Queue the writing of buffer @buf in blocks @block to @block + @count - 1.
+ * Buffer @buf must not be modified until block_aio_wait() has returned. If
+ * asynchronous I/O is not set up, the blocks are written right away.
+ *
+ * Return: -1 if any of the blocks is out of bounds or if the request cannot be
+ * queued. 0 otherwise.
+ */
+int block_aio_write(size_t block, size_t count, const void *buf);
+
+/**
+ * block_aio_prefetch - Submit a read of contiguous blocks with its own status
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ * @failed: Flag set if the read fails
+ *
+ * Queue the reading of blocks @block to @block + @count - 1 into buffer @buf,
+ * like block_aio_read(), except that the failure of the request sets flag
+ * @failed instead of being reported to the calling thread. This lets any
+ * thread find out, after block_aio_drain(), which of such reads failed.
+ *
+ * Return: -1 if any of the blocks is out of bounds or if the request cannot be
+ * queued. 0 otherwise.
+ */
+int block_aio_prefetch(size_t block, size_t count, void *buf, bool *failed);
+
+/**
+ * block_aio_submit - Start queued requests
+ *
+ * Hand the queued requests to the kernel without waiting for them, so that
+ * they proceed in the background until block_aio_wait() is called.
+ *
+ * Return: -1 if the requests cannot be submitted. 0 otherwise.
+ */
+int block_aio_submit(void);
+
+/**
+ * block_aio_drain - Reap submitted requests of every thread
+ *
+ * Submit the queued requests to the kernel, and wait until every request in
+ * flight has completed, without reporting their failures.
+ *
+ * Return: -1 if the requests cannot be submitted or reaped. 0 otherwise.
+ */
+int block_aio_drain(void);
+
+/**
+ * block_aio_wait - Reap submitted requests
+ *
+ * Submit the queued requests to the kernel, and wait until every request in
+ * flight has completed. Threads can submit and wait concurrently; each one is
+ * told about the failure of its own requests.
+ *
+ * Return: -1 if any request submitted by the calling thread since its last
+ * call failed. 0 otherwise.
+ */
+int block_aio_wait(void);
+
+/**
+ * struct block_stats - Disk access counters
+ * @reads: Number of read requests
+ * @writes: Number of write requests
+ * @bytes_read: Number of bytes read
+ * @bytes_written: Number of bytes written
+ *
+ * Every call to block_read(), block_write(), the range functions and the
+ * asynchronous functions counts as a request, and so does every request that
+ * block_readv() and block_writev() merge their entries into.
+ */
+struct block_stats {
+	unsigned long long reads;
+	unsigned long long writes;
+	unsigned long long bytes_read;
+	unsigned long long bytes_written;
+};
+
+/**
+ * block_get_stats - Get disk access counters
+ * @st: Counters to fill
+ *
+ * Get the counters accumulated since the program started, or since the last
+ * call to block_reset_stats().
+ */
+void block_get_stats(struct block_stats *st);
+
+/**
+ * block_reset_stats - Reset disk access counters
+ */
+void block_reset_stats(void);
+
 #endif /* _DISK_H */
 
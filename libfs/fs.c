@@ -4,19 +4,67 @@
 #include <stdint.h>
 #include <string.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <time.h>
 
+#include "cache.h"
 #include "disk.h"
 #include "fs.h"
+#include "journal.h"
+#include "pool.h"
+#include "scan.h"
+#include "trace.h"
 
 #define EXIT_NOERR 0
 #define EXIT_ERR -1
-#define FAT_EOC 0xFFFF
-#define WRITE_MODE 1
-#define READ_MODE 0
+/* end of chain marker of the in-memory FAT, and of the FAT of 16-bit disks */
+#define FAT_EOC 0xFFFFFFFF
+#define FAT16_EOC 0xFFFF
+/* signatures of the superblock of 16-bit disks, and of the versioned
+ * superblock of later formats */
+#define SIGNATURE16 "ECS150FS"
+#define SIGNATURE_VERSIONED "ECS150FV"
+/* largest number of blocks moved by a single disk request */
+#define RUN_MAX_BLOCKS 256
+/* number of delayed blocks of a file that triggers their allocation */
+#define DELAY_MAX_BLOCKS 1024
+/* number of buckets of the filename index (power of two) */
+#define NAME_BUCKETS 256
+#define NO_FILE -1
+/* a file descriptor is made of a generation and a descriptor table slot, in
+ * the 31 bits of a non-negative int: the slot takes as few bits as the size
+ * of the table needs (16 at most), and the generation the others (15 at
+ * least); a slot whose generations are all used up is retired until unmount,
+ * so that fs_open() fails after 2^30 to 2^31 opens in a mount rather than
+ * handing out the value of a closed descriptor again */
+#define FD_BITS 31
+/* smallest number of whole blocks read by a read spread over several threads,
+ * and smallest number of blocks read by each thread */
+#define FANOUT_MIN_BLOCKS 512
+#define FANOUT_PART_BLOCKS 128
+/* owners of data blocks in the reachability map of fs_check(): a block
+ * reached by several chains belongs to the journal, or else to the file of
+ * lowest index */
+#define OWNER_NONE 0
+#define OWNER_JOURNAL 1
+#define OWNER_FILE(i) ((i) + 2)
+/* largest number of FAT entries followed from a descriptor's cursor before
+ * looking a block up in the file's extent map instead */
+#define CURSOR_MAX_STEPS 16
+/* initial and largest readahead windows, in blocks */
+#define RA_MIN_BLOCKS 4
+#define RA_MAX_BLOCKS 64
+/* journal record types */
+#define JR_FAT 1
+#define JR_ROOT 2
+/* largest size of a journal record of each type */
+#define JR_FAT_SIZE(count) (7 + 4 * (count))
+#define JR_ROOT_SIZE (2 + sizeof(struct root))
 
 #define UNUSED(x) (void)(x)
 
+/* superblock of 16-bit disks (FS_FORMAT_FAT16) */
 struct __attribute__((__packed__)) super_block {
 	char signiture[8];
 	uint16_t block_total;
@@ -24,14 +72,52 @@ struct __attribute__((__packed__)) super_block {
 	uint16_t data_index;
 	uint16_t data_block_total;
 	uint8_t fat_block_total;
-	uint8_t padding[BLOCK_SIZE - 17];
+	/* metadata journal region, or 0 if the disk has no journal */
+	uint16_t journal_index;
+	uint16_t journal_block_total;
+	uint8_t padding[BLOCK_SIZE - 21];
+};
+
+/* versioned superblock, of 32-bit disks (FS_FORMAT_FAT32) */
+struct __attribute__((__packed__)) super_block32 {
+	char signiture[8];
+	uint16_t version;
+	uint32_t block_total;
+	uint32_t root_index;
+	uint32_t data_index;
+	uint32_t data_block_total;
+	uint32_t fat_block_total;
+	uint32_t journal_index;
+	uint32_t journal_block_total;
+	uint8_t padding[BLOCK_SIZE - 38];
+};
+
+/* superblock of the mounted disk, whatever its format */
+struct super_info {
+	int version;
+	uint32_t block_total;
+	uint32_t root_index;
+	uint32_t data_index;
+	uint32_t data_block_total;
+	uint32_t fat_block_total;
+	uint32_t journal_index;
+	uint32_t journal_block_total;
 };
 
 struct __attribute__((__packed__)) FAT {
-	uint16_t *block_table;
+	uint32_t *block_table;
 };
 
+/* root directory entry, in memory and on 32-bit disks */
 struct __attribute__((__packed__)) root {
+	char filename[FS_FILENAME_LEN];
+	uint32_t file_size;
+	uint32_t data_index;
+	uint8_t padding[8];
+};
+
+/* root directory entry on 16-bit disks */
+struct __attribute__((__packed__)) root16 {
 	char filename[FS_FILENAME_LEN];
 	uint32_t file_size;
 	uint16_t data_index;
@@ -40,608 +126,3640 @@ struct __attribute__((__packed__)) root {
 
 struct __attribute__((__packed__)) file_descriptor {
 	int32_t fd;
+	bool open;
+	uint32_t generation;
 	uint32_t offset;
-	uint32_t file_size;
-	char filename[FS_FILENAME_LEN];
 	int root_index;
+	/* last data block accessed, as logical block and FAT index, and
+	 * generation of the file's chain it belongs to */
+	uint32_t cur_block;
+	uint32_t cur_index;
+	uint16_t cur_gen;
+	/* readahead state: logical block where the next sequential read starts,
+	 * end of the blocks already prefetched, and window size */
+	uint32_t ra_next;
+	uint32_t ra_end;
+	uint16_t ra_window;
+	/* staging buffer of small writes: logical block and FAT index of the
+	 * staged block, and range of staged bytes in it (empty if end is 0) */
+	char *stage;
+	uint32_t stage_block;
+	uint32_t stage_index;
+	uint16_t stage_start;
+	uint16_t stage_end;
+	/* next descriptor of the file with staged writes */
+	struct file_descriptor *stage_next;
 };
 
-struct super_block superblock;
+struct super_info superblock;
 struct FAT fatblock;
 struct root rootdirectory[FS_FILE_MAX_COUNT];
-uint16_t* table;
+uint32_t* table;
 bool file_system_open = false;
-struct file_descriptor fd_open_list[FS_OPEN_MAX_COUNT];
 int open_files = 0;
-int global_fd = 0;
 
-int fs_mount(const char *diskname)
+/* descriptor table, lock of each descriptor, and stack of free slots; the
+ * stack holds the slots not retired (fd_slot_count) and not open */
+static struct file_descriptor *fd_table;
+static pthread_mutex_t *fd_locks;
+static uint16_t *fd_free_slots;
+static size_t fd_table_size;
+static size_t fd_slot_count;
+static unsigned int fd_slot_bits;
+
+/*
+ * Locks, always taken in this order:
+ * - mount_lock, shared by file operations, and held exclusively to mount,
+ *   unmount, and write back or commit the metadata of the whole file system;
+ * - the lock of a descriptor (fd_locks), for its offset, cursor and readahead
+ *   state;
+ * - the lock of a file (file_locks), shared to read it and held exclusively
+ *   to write it, for its data, chain, size and staged writes;
+ * - root_lock, for the root directory entries in use, the filename index, the
+ *   open counts and the root directory dirty state;
+ * - alloc_lock, for the FAT, the free blocks and the FAT dirty state;
+ * - fd_table_lock, for the free slots of the descriptor table.
+ */
+static pthread_rwlock_t mount_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t file_locks[FS_FILE_MAX_COUNT] = {
+	[0 ... FS_FILE_MAX_COUNT - 1] = PTHREAD_RWLOCK_INITIALIZER
+};
+static pthread_mutex_t root_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t fd_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* end and length of a file's data block chain */
+struct chain {
+	uint32_t last_block;
+	uint32_t length;
+};
+
+/* physically contiguous data blocks of a file, from its block @logical */
+struct extent {
+	uint32_t logical;
+	uint32_t block;
+	uint32_t length;
+};
+
+/* extents of a file's whole chain, sorted by logical block */
+struct extent_map {
+	size_t count;
+	size_t capacity;
+	struct extent extents[];
+};
+
+/* number of FAT entries held by a FAT block of the mounted disk */
+static size_t fat_per_block;
+
+/* metadata blocks changed since last written back: one flag per FAT block,
+ * root directory, and superblock */
+static uint8_t *fat_dirty;
+static bool root_dirty;
+static bool super_dirty;
+
+/* metadata journal state: a commit is due, operations since last commit and
+ * number of them batched per commit, and changes not committed yet (one bit per FAT entry,
+ * one flag per root directory entry) */
+static bool journal_on;
+static bool commit_due;
+static unsigned int journal_ops;
+static unsigned int journal_group;
+static uint64_t *jdirty_fat;
+static size_t jdirty_fat_count;
+static bool jdirty_root[FS_FILE_MAX_COUNT];
+static size_t jdirty_root_count;
+
+/* metadata as of the last commit, in the layout of the in-memory metadata:
+ * what replaying the journal over the disk gives back */
+static uint32_t *jcommit_fat;
+static struct root jcommit_root[FS_FILE_MAX_COUNT];
+
+/* filename index: hash buckets and next entry of each root directory entry */
+static int16_t name_buckets[NAME_BUCKETS] = {
+	[0 ... NAME_BUCKETS - 1] = NO_FILE
+};
+static int16_t name_next[FS_FILE_MAX_COUNT];
+
+/* number of file descriptors open on each root directory entry, and list of
+ * them with staged writes */
+static int open_count[FS_FILE_MAX_COUNT];
+static struct file_descriptor *stage_list[FS_FILE_MAX_COUNT];
+
+/* free data blocks (one bit per FAT entry), next-fit hint, and count */
+static uint64_t *free_map;
+static size_t free_hint;
+static size_t free_count;
+
+/* written blocks past the end of a file's chain, not allocated yet */
+struct pending {
+	char *data;
+	size_t nblocks;
+	size_t capacity;
+};
+
+/* chain of each root directory entry */
+static struct chain chains[FS_FILE_MAX_COUNT];
+
+/* extent map of each file, built when first needed by a lookup (readers race
+ * to publish it), then extended by appends under the file's write lock, and
+ * dropped when the chain is freed or changed otherwise */
+static struct extent_map *extent_maps[FS_FILE_MAX_COUNT];
+
+/* generation of each file's chain, changed when its blocks move, which makes
+ * the cursors into the old blocks stale (under the file's lock) */
+static uint16_t chain_gens[FS_FILE_MAX_COUNT];
+
+/* file where the next fs_defrag() starts, and number of fs_defrag() calls
+ * moving each file, which fs_delete() waits for (under root_lock) */
+static int defrag_next;
+static int move_count[FS_FILE_MAX_COUNT];
+
+/* delayed allocation state: buffered blocks of each root directory entry, and
+ * count of free blocks promised to them */
+static bool delay_alloc;
+static struct pending pending[FS_FILE_MAX_COUNT];
+static size_t reserved_count;
+
+/* runs of whole blocks of a read or write are submitted asynchronously */
+static bool aio_on;
+
+/* state of the chain of a file checked by fs_check() */
+struct check_chain {
+	/* number of blocks before the first invalid or repeated one, if any */
+	size_t length;
+	bool broken;
+	bool cycle;
+	/* number of blocks before the first one owned by the journal or another
+	 * file, and that owner */
+	size_t shared_at;
+	uint8_t shared_with;
+};
+
+/* state of fs_check(): part i checks files i, i + parts, ... */
+struct check {
+	uint8_t *owner;
+	size_t parts;
+	struct check_chain chains[FS_FILE_MAX_COUNT];
+};
+
+/* large reads are spread over this many threads (worker pool and caller) */
+static size_t fanout_threads;
+
+/* physically contiguous blocks of a spread read, and where they go in the
+ * user buffer */
+struct fanout_run {
+	size_t block;
+	size_t count;
+	char *buf;
+};
+
+/* read spread over several threads: part i reads runs part_start[i] to
+ * part_start[i + 1] - 1 */
+struct fanout {
+	struct fanout_run *runs;
+	size_t *part_start;
+};
+
+/* statistics, but for the disk counters kept by the disk layer */
+static struct fs_stats stats;
+
+static void stat_add(unsigned long long *counter, unsigned long long n)
 {
-	/* disk cannot be opened */
-	if (block_disk_open(diskname)) {
-		printf("diskname\n");
-		return EXIT_ERR;
-	}	
-	
-	if (block_read(0, &superblock)) {
-		printf("read super\n");
-		return EXIT_ERR;
-	}
-	
-	table = malloc(superblock.fat_block_total * BLOCK_SIZE);
-	fatblock.block_table = table;
-	
-	for (int i = 0; i < superblock.fat_block_total; i++) {
-		if (block_read(i + 1, table + ((i * BLOCK_SIZE) / 2))) {
-			printf("read fat\n");
-			free(table);
-			return EXIT_ERR;
-		}
-	}
-	
-	if (block_read(superblock.root_index, &rootdirectory)) {
-		printf("read root\n");
-		free(table);
-		return EXIT_ERR;
-	}
-	
-	file_system_open = true;
-	return EXIT_NOERR;
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
 }
 
-int fs_umount(void)
+static unsigned int name_hash(const char *filename)
 {
-	/* still open file descriptors */
-	if (open_files) {
-		printf("open file descriptors\n");
-		return EXIT_ERR;
+	uint32_t hash = 2166136261u;
+
+	while (*filename) {
+		hash = (hash ^ (uint8_t)*filename++) * 16777619u;
 	}
 
-	if (block_write(0, &superblock)) {
-		printf("write super\n");
-		return EXIT_ERR;
+	return hash & (NAME_BUCKETS - 1);
+}
+
+static void index_file(int i)
+{
+	unsigned int bucket = name_hash(rootdirectory[i].filename);
+
+	name_next[i] = name_buckets[bucket];
+	name_buckets[bucket] = i;
+}
+
+static void unindex_file(int i)
+{
+	int16_t *link = &name_buckets[name_hash(rootdirectory[i].filename)];
+
+	while (*link != i) {
+		link = &name_next[*link];
 	}
+	*link = name_next[i];
+}
 
-	for (int i = 0; i < superblock.fat_block_total; i++) {
-		if (block_write(i + 1, table + ((i * BLOCK_SIZE) / 2))) {
-			printf("write fat\n");
-			free(table);
-			return EXIT_ERR;
-		}
+/* returns the root directory entry of file @filename, or NO_FILE */
+static int find_file(const char *filename)
+{
+	int i = name_buckets[name_hash(filename)];
+
+	while (i != NO_FILE && strcmp(rootdirectory[i].filename, filename)) {
+		i = name_next[i];
 	}
 
-	if (block_write(superblock.root_index, &rootdirectory)) {
-		printf("write root\n");
-		return EXIT_ERR;
+	return i;
+}
+
+/* returns the largest generation of a descriptor table slot */
+static uint32_t fd_generation_max(void)
+{
+	return ((uint32_t)1 << (FD_BITS - fd_slot_bits)) - 1;
+}
+
+/* returns the descriptor of open file @fd, locked, or NULL */
+static struct file_descriptor *lock_fd(int fd)
+{
+	size_t slot = fd & ((1 << fd_slot_bits) - 1);
+
+	if (fd < 0 || slot >= fd_table_size) {
+		return NULL;
 	}
 
-	/* close underlying virtual disk file */
-	if (block_disk_close()) {
-		printf("no file open\n");
-		return EXIT_ERR;
+	pthread_mutex_lock(&fd_locks[slot]);
+	if (!fd_table[slot].open || fd_table[slot].fd != fd) {
+		pthread_mutex_unlock(&fd_locks[slot]);
+		return NULL;
 	}
 
-	free(table);
-	file_system_open = false;
-	
-	return EXIT_NOERR;
+	return &fd_table[slot];
 }
 
-int fs_info(void)
+static void unlock_fd(struct file_descriptor *file_des)
 {
-	int i, count = 0;
-	if (!file_system_open) {
-		printf("file\n");
+	pthread_mutex_unlock(&fd_locks[file_des - fd_table]);
+}
+
+/* sets up an empty descriptor table of @size slots */
+static int build_fd_table(size_t size)
+{
+	size_t slot;
+
+	fd_table = calloc(size, sizeof(*fd_table));
+	fd_locks = malloc(size * sizeof(*fd_locks));
+	fd_free_slots = malloc(size * sizeof(*fd_free_slots));
+	if (fd_table == NULL || fd_locks == NULL || fd_free_slots == NULL) {
+		free(fd_table);
+		free(fd_locks);
+		free(fd_free_slots);
+		fd_table = NULL;
+		fd_locks = NULL;
+		fd_free_slots = NULL;
 		return EXIT_ERR;
 	}
-	
-	printf("FS Info:\n");
-	printf("total_blk_count=%d\n", superblock.block_total);
-	printf("fat_blk_count=%d\n", superblock.fat_block_total);
-	printf("rdir_blk=%d\n", superblock.root_index);
-	printf("data_blk=%d\n", superblock.data_index);
-	printf("data_blk_count=%d\n", superblock.data_block_total);
-	
-	for (i = 0; i < superblock.data_block_total; i++) {
-		if (fatblock.block_table[i] == 0) {
-			count++;
-		}
+
+	/* lowest slots get handed out first */
+	for (slot = 0; slot < size; slot++) {
+		pthread_mutex_init(&fd_locks[slot], NULL);
+		fd_free_slots[slot] = size - 1 - slot;
 	}
-	
-	printf("fat_free_ratio=%d/%d\n", count, superblock.data_block_total);
-	
-	count = 0;
-	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (rootdirectory[i].data_index == 0) {
-			count++;
-		}
+	fd_table_size = size;
+	fd_slot_count = size;
+	for (fd_slot_bits = 0; ((size_t)1 << fd_slot_bits) < size;
+			fd_slot_bits++) {
 	}
-	
-	printf("rdir_free_ratio=%d/%d\n", count, FS_FILE_MAX_COUNT);
-	
+	open_files = 0;
+
 	return EXIT_NOERR;
 }
 
-int fs_create(const char *filename)
+/* empties the filename index */
+static void clear_name_index(void)
 {
-	/* filename invalid */
-	if (filename == NULL) {
-		return EXIT_ERR;
+	int i;
+
+	for (i = 0; i < NAME_BUCKETS; i++) {
+		name_buckets[i] = NO_FILE;
 	}
 
-	/* filename too long */
-	if (strlen(filename) >= FS_FILENAME_LEN) {
-		return EXIT_ERR;
+	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		name_next[i] = NO_FILE;
 	}
+}
 
-	/* check if file already exists */
+/* builds the filename index of the root directory */
+static void build_name_index(void)
+{
 	int i;
+
+	clear_name_index();
+
 	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (!strcmp(rootdirectory[i].filename, filename)) {
-			return EXIT_ERR;
+		open_count[i] = 0;
+		stage_list[i] = NULL;
+		if (rootdirectory[i].filename[0] != '\0') {
+			/* entries are NULL-terminated in memory whatever the disk says */
+			rootdirectory[i].filename[FS_FILENAME_LEN - 1] = '\0';
+			index_file(i);
 		}
 	}
+}
 
-	/* find empty entry in root directory */
-	int empty = -1;
-	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (rootdirectory[i].filename[0] == '\0') {
-			/* empty */
-			empty = i;
-			break;
+/* writes the staged bytes of a descriptor to their block */
+static int flush_stage(struct file_descriptor *file_des)
+{
+	struct file_descriptor *prev;
+	size_t block_start, live;
+	char bounce_buffer[BLOCK_SIZE];
+	int i = file_des->root_index;
+
+	if (file_des->stage_end == 0) {
+		return EXIT_NOERR;
+	}
+
+	/* only read the block back if some of its live data is not staged */
+	block_start = (size_t)file_des->stage_block * BLOCK_SIZE;
+	live = rootdirectory[i].file_size - block_start;
+	if (file_des->stage_start > 0 || file_des->stage_end < live) {
+		if (cache_read(file_des->stage_index + superblock.data_index,
+					bounce_buffer)) {
+			return EXIT_ERR;
 		}
+	} else {
+		memset(bounce_buffer, 0, BLOCK_SIZE);
 	}
 
-	/* root directory is full */
-	if (empty < 0) {
+	memcpy(bounce_buffer + file_des->stage_start,
+			file_des->stage + file_des->stage_start,
+			file_des->stage_end - file_des->stage_start);
+	if (cache_write(file_des->stage_index + superblock.data_index,
+				bounce_buffer)) {
 		return EXIT_ERR;
 	}
 
-	strcpy(rootdirectory[empty].filename, filename);
-	rootdirectory[empty].file_size = 0;
-	rootdirectory[empty].data_index = FAT_EOC;
+	file_des->stage_start = 0;
+	file_des->stage_end = 0;
+	if (stage_list[i] == file_des) {
+		stage_list[i] = file_des->stage_next;
+	} else {
+		for (prev = stage_list[i]; prev->stage_next != file_des;
+				prev = prev->stage_next) {
+		}
+		prev->stage_next = file_des->stage_next;
+	}
 
 	return EXIT_NOERR;
 }
 
-int fs_delete(const char *filename)
+/* flushes the staged writes of the descriptors of file @i but @skip, so that
+ * other accesses to the file see them */
+static int flush_file_stages(int i, struct file_descriptor *skip)
 {
-	/* filename invalid */
-	if (filename == NULL) {
-		return EXIT_ERR;
-	}
-	
-	/* find the file */
-	int i;
-	int file_index = -1;
-	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (!strcmp(rootdirectory[i].filename, filename)) {
-			file_index = i;
-			break;
-		}
-	}
-	
-	/* no file filename to delete */
-	if (file_index < 0) {
-		return EXIT_ERR;
-	}
+	struct file_descriptor *file_des = stage_list[i], *next;
 
-	/* file is still open */
-	for (i = 0; i < open_files; i++) {
-		if (!strcmp(fd_open_list[i].filename, filename)) {
+	while (file_des != NULL) {
+		next = file_des->stage_next;
+		if (file_des != skip && flush_stage(file_des)) {
 			return EXIT_ERR;
 		}
+		file_des = next;
 	}
 
-	/* free all data blocks containing file's contents in the FAT */
-	uint16_t old_index, next_index = rootdirectory[file_index].data_index;
-	while (next_index != FAT_EOC) {
-		old_index = next_index;
-		next_index = fatblock.block_table[next_index];
-		fatblock.block_table[old_index] = 0;
-	}
-
-	/* empty file's entry */
-	rootdirectory[file_index].filename[0] = '\0';
-	rootdirectory[file_index].file_size = 0;
-	rootdirectory[file_index].data_index = 0;
-
 	return EXIT_NOERR;
 }
 
-int fs_ls(void)
+static int flush_all_stages(void)
 {
-	printf("FS Ls:\n");
-
-	/* no underlying virtual disk open */
-	if (!file_system_open) {
-		return EXIT_ERR;
-	}
-	
 	int i;
+
 	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (rootdirectory[i].filename[0] != '\0') {
-			printf("file: %s, size: %u, data_blk: %u\n",
-					rootdirectory[i].filename,
-					rootdirectory[i].file_size,
-					rootdirectory[i].data_index);
+		if (flush_file_stages(i, NULL)) {
+			return EXIT_ERR;
 		}
 	}
-	
+
 	return EXIT_NOERR;
 }
 
-int fs_open(const char *filename)
+/* returns the size of a FAT entry on disks of format @version */
+static size_t fat_entry_size(int version)
 {
-	int root_index = -1;
-	struct file_descriptor file_des;
-	
-	if (filename == NULL) {
-		return EXIT_ERR;
-	}
+	return version == FS_FORMAT_FAT16 ? sizeof(uint16_t) : sizeof(uint32_t);
+}
 
-	if (open_files == FS_OPEN_MAX_COUNT) {
-		return EXIT_ERR;
+/* converts a FAT entry or block number of the mounted disk to its in-memory
+ * value, and back: only the end of chain marker of 16-bit disks differs */
+static uint32_t fat_from_disk(uint32_t value)
+{
+	if (superblock.version == FS_FORMAT_FAT16 && value == FAT16_EOC) {
+		return FAT_EOC;
 	}
 
-	int i;
-	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (!strcmp(rootdirectory[i].filename, filename)) {
-			root_index = i;
-			break;
-		}
-	}
+	return value;
+}
 
-	if (root_index < 0) {
-		return EXIT_ERR;
+static uint32_t fat_to_disk(uint32_t value)
+{
+	if (superblock.version == FS_FORMAT_FAT16 && value == FAT_EOC) {
+		return FAT16_EOC;
 	}
-	
-	file_des.fd = global_fd;
-	file_des.offset = 0;
-	strcpy(file_des.filename, filename);
-	file_des.file_size = rootdirectory[root_index].file_size;
-	file_des.root_index = root_index;
-
-	fd_open_list[open_files] = file_des;
-	open_files += 1;
-	global_fd += 1;
 
-	return file_des.fd;
+	return value;
 }
 
-int fs_close(int fd)
+/* reads the superblock of the disk, whose signature tells its format */
+static int read_super(void)
 {
-	if (fd < 0) {
-		return EXIT_ERR;
-	}
+	union {
+		struct super_block v16;
+		struct super_block32 v32;
+	} disk;
 
-	int i;
-	int index = -1;
-	for (i = 0; i < open_files; i++) {
-		if (fd_open_list[i].fd == fd) {
-			index = i;
-			break;
-		}
-	}
-
-	/* file fd not currently open */
-	if (index < 0) {
+	if (block_read(0, &disk)) {
 		return EXIT_ERR;
 	}
 
-	for (i = index; i < open_files - 1; i++) {
-		fd_open_list[i] = fd_open_list[i + 1];
+	if (memcmp(disk.v16.signiture, SIGNATURE16, 8) == 0) {
+		superblock.version = FS_FORMAT_FAT16;
+		superblock.block_total = disk.v16.block_total;
+		superblock.root_index = disk.v16.root_index;
+		superblock.data_index = disk.v16.data_index;
+		superblock.data_block_total = disk.v16.data_block_total;
+		superblock.fat_block_total = disk.v16.fat_block_total;
+		superblock.journal_index = disk.v16.journal_index;
+		superblock.journal_block_total = disk.v16.journal_block_total;
+	} else if (memcmp(disk.v32.signiture, SIGNATURE_VERSIONED, 8) == 0 &&
+			disk.v32.version == FS_FORMAT_FAT32) {
+		superblock.version = FS_FORMAT_FAT32;
+		superblock.block_total = disk.v32.block_total;
+		superblock.root_index = disk.v32.root_index;
+		superblock.data_index = disk.v32.data_index;
+		superblock.data_block_total = disk.v32.data_block_total;
+		superblock.fat_block_total = disk.v32.fat_block_total;
+		superblock.journal_index = disk.v32.journal_index;
+		superblock.journal_block_total = disk.v32.journal_block_total;
+	} else {
+		return EXIT_ERR;
 	}
 
-	open_files -= 1;
+	fat_per_block = BLOCK_SIZE / fat_entry_size(superblock.version);
 
 	return EXIT_NOERR;
 }
 
-int fs_stat(int fd)
+/* writes the superblock in the format of the disk */
+static int write_super(void)
 {
-	if (fd < 0) {
-		return EXIT_ERR;
-	}
-	
-	int i;
-	int index = -1;
-	for (i = 0; i < open_files; i++) {
-		if (fd_open_list[i].fd == fd) {
-			index = i;
-			break;
-		}
+	union {
+		struct super_block v16;
+		struct super_block32 v32;
+	} disk;
+
+	memset(&disk, 0, sizeof(disk));
+	if (superblock.version == FS_FORMAT_FAT16) {
+		memcpy(disk.v16.signiture, SIGNATURE16, 8);
+		disk.v16.block_total = superblock.block_total;
+		disk.v16.root_index = superblock.root_index;
+		disk.v16.data_index = superblock.data_index;
+		disk.v16.data_block_total = superblock.data_block_total;
+		disk.v16.fat_block_total = superblock.fat_block_total;
+		disk.v16.journal_index = superblock.journal_index;
+		disk.v16.journal_block_total = superblock.journal_block_total;
+	} else {
+		memcpy(disk.v32.signiture, SIGNATURE_VERSIONED, 8);
+		disk.v32.version = superblock.version;
+		disk.v32.block_total = superblock.block_total;
+		disk.v32.root_index = superblock.root_index;
+		disk.v32.data_index = superblock.data_index;
+		disk.v32.data_block_total = superblock.data_block_total;
+		disk.v32.fat_block_total = superblock.fat_block_total;
+		disk.v32.journal_index = superblock.journal_index;
+		disk.v32.journal_block_total = superblock.journal_block_total;
 	}
 
-	/* file fd not currently open */
-	if (index < 0) {
-		return EXIT_ERR;
-	}
-
-	return rootdirectory[fd_open_list[index].root_index].file_size;
+	return block_write(0, &disk);
 }
 
-int fs_lseek(int fd, size_t offset)
+/* reads FAT block @i into the in-memory FAT */
+static int read_fat_block(size_t i)
 {
-	if (fd < 0) {
-		return EXIT_ERR;
-	}
+	uint32_t *entries = table + i * fat_per_block;
+	uint16_t disk[BLOCK_SIZE / sizeof(uint16_t)];
+	size_t j;
 
-	int i;
-	int index = -1;
-	for (i = 0; i < open_files; i++) {
-		if (fd_open_list[i].fd == fd) {
-			index = i;
-			break;
-		}
+	if (superblock.version != FS_FORMAT_FAT16) {
+		return block_read(i + 1, entries);
 	}
 
-	if (index < 0) {
+	if (block_read(i + 1, disk)) {
 		return EXIT_ERR;
 	}
-
-	if (offset > fd_open_list[index].file_size) {
-		return EXIT_ERR;
+	for (j = 0; j < fat_per_block; j++) {
+		entries[j] = fat_from_disk(disk[j]);
 	}
 
-	fd_open_list[index].offset = offset;
-
 	return EXIT_NOERR;
 }
 
-/* allocates new data block and links it at end of file's data block chain */
-bool new_block(uint16_t i)
-{	
-	int j;
-	uint16_t next_index;
-	bool found_empty = false;
-	
-	for (j = 0; j < superblock.data_block_total; j++) {
-		if (fatblock.block_table[j] == 0) {
-			found_empty = true;
-			fatblock.block_table[j] = FAT_EOC;
-			if (rootdirectory[i].data_index == FAT_EOC) {
-				rootdirectory[i].data_index = j;
-			} else {
-				next_index = rootdirectory[i].data_index;
-				while (fatblock.block_table[next_index] != FAT_EOC) {
-					next_index = fatblock.block_table[next_index];
-				}
-				fatblock.block_table[next_index] = j;
-			}
-			break;
-		}
+/* writes FAT block @i from FAT @fat, laid out as the in-memory FAT */
+static int write_fat_block(const uint32_t *fat, size_t i)
+{
+	const uint32_t *entries = fat + i * fat_per_block;
+	uint16_t disk[BLOCK_SIZE / sizeof(uint16_t)];
+	size_t j;
+
+	if (superblock.version != FS_FORMAT_FAT16) {
+		return block_write(i + 1, entries);
+	}
+
+	for (j = 0; j < fat_per_block; j++) {
+		disk[j] = fat_to_disk(entries[j]);
 	}
-	return found_empty;
+
+	return block_write(i + 1, disk);
 }
-		
-/* returns the index of the data block corresponding to file's offset */
-static int16_t find_block(int fd, int offset, int* mode)
+
+/* encodes root directory entry @root in the format of the disk into @entry,
+ * of sizeof(struct root) bytes in both formats */
+static void encode_root(const struct root *root, void *entry)
 {
-	int16_t index = -1;
-	char filename[FS_FILENAME_LEN];
+	struct root16 disk;
+
+	if (superblock.version != FS_FORMAT_FAT16) {
+		memcpy(entry, root, sizeof(struct root));
+		return;
+	}
+
+	memset(&disk, 0, sizeof(disk));
+	memcpy(disk.filename, root->filename, FS_FILENAME_LEN);
+	disk.file_size = root->file_size;
+	disk.data_index = fat_to_disk(root->data_index);
+	memcpy(entry, &disk, sizeof(disk));
+}
+
+/* decodes root directory entry @root from @entry, in the format of the disk */
+static void decode_root(struct root *root, const void *entry)
+{
+	struct root16 disk;
+
+	if (superblock.version != FS_FORMAT_FAT16) {
+		memcpy(root, entry, sizeof(struct root));
+		return;
+	}
+
+	memcpy(&disk, entry, sizeof(disk));
+	memset(root, 0, sizeof(struct root));
+	memcpy(root->filename, disk.filename, FS_FILENAME_LEN);
+	root->file_size = disk.file_size;
+	root->data_index = fat_from_disk(disk.data_index);
+}
+
+static int read_root(void)
+{
+	struct root disk[FS_FILE_MAX_COUNT];
 	int i;
-	
-	/* get filename from fd */
-	for (i = 0; i < open_files; i++) {
-		if (fd_open_list[i].fd == fd) {
-			strcpy(filename, fd_open_list[i].filename);
-			break;
-		}
+
+	if (block_read(superblock.root_index, disk)) {
+		return EXIT_ERR;
 	}
-	
-	/* locate start of file's data blocks */
 	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (!strcmp(rootdirectory[i].filename, filename)) {
-			if (rootdirectory[i].data_index == FAT_EOC) {
-				if (*mode == WRITE_MODE) {
-					if (new_block(i)) {
-						*mode += 1;
-					} else {
-						return EXIT_ERR;
-					}
-				}
-				else {
-					return EXIT_ERR;
-				}
-			}
-			index = rootdirectory[i].data_index;
-			break;
+		decode_root(&rootdirectory[i], &disk[i]);
+	}
+
+	return EXIT_NOERR;
+}
+
+/* writes the root directory from @dir */
+static int write_root(const struct root *dir)
+{
+	struct root disk[FS_FILE_MAX_COUNT];
+	int i;
+
+	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		encode_root(&dir[i], &disk[i]);
+	}
+
+	return block_write(superblock.root_index, disk);
+}
+
+/* updates FAT entry @j and marks its FAT block dirty (under alloc_lock) */
+static void set_fat(uint32_t j, uint32_t value)
+{
+	fatblock.block_table[j] = value;
+	fat_dirty[j / fat_per_block] = 1;
+
+	if (journal_on && !(jdirty_fat[j / 64] & ((uint64_t)1 << (j % 64)))) {
+		jdirty_fat[j / 64] |= (uint64_t)1 << (j % 64);
+		jdirty_fat_count++;
+	}
+}
+
+/* marks root directory entry @i changed (under root_lock) */
+static void mark_root(int i)
+{
+	root_dirty = true;
+
+	if (journal_on && !jdirty_root[i]) {
+		jdirty_root[i] = true;
+		jdirty_root_count++;
+	}
+}
+
+/* writes back the metadata blocks changed since last written back */
+static int sync_metadata(void)
+{
+	size_t i;
+
+	if (super_dirty) {
+		if (write_super()) {
+			printf("write super\n");
+			return EXIT_ERR;
 		}
+		super_dirty = false;
 	}
 
-	/* traverse the data blocks until reach offset */
-	while (offset >= BLOCK_SIZE) {
-		if (fatblock.block_table[index] == FAT_EOC) {
-			if (*mode == WRITE_MODE) {
-				if (new_block(i)) {
-					*mode += 1;
-				} else {
-					return EXIT_ERR;
-				}
-			}
-			else {
-				return EXIT_ERR;
-			}
+	for (i = 0; i < superblock.fat_block_total; i++) {
+		if (!fat_dirty[i]) {
+			continue;
 		}
-		index = fatblock.block_table[index];
-		offset -= BLOCK_SIZE;
+		if (write_fat_block(table, i)) {
+			printf("write fat\n");
+			return EXIT_ERR;
+		}
+		fat_dirty[i] = 0;
 	}
-	
-	/* account for super block, fat, and rootdirectory */
-	return index + superblock.data_index;
+
+	if (root_dirty) {
+		if (write_root(rootdirectory)) {
+			printf("write root\n");
+			return EXIT_ERR;
+		}
+		root_dirty = false;
+	}
+
+	return EXIT_NOERR;
 }
-	
-int fs_write(int fd, void *buf, size_t count)
+
+/* writes the metadata in place and empties the journal */
+static int checkpoint_journal(void)
 {
-	/* invalid */
-	if (fd < 0) {
+	if (sync_metadata()) {
 		return EXIT_ERR;
 	}
-	
-	int i;
-	int fd_index = -1;
-	uint32_t offset, old_offset, buf_offset = 0;
-	uint32_t file_size = 0;	
-	int bytes_written = 0;
-	int bytes_added = 0;
-	int mode = WRITE_MODE;
-	int16_t block_index;
-
-	/* get offset from fd */
-	for (i = 0; i < open_files; i++) {
-		if (fd_open_list[i].fd == fd) {
-			fd_index = i;
-			offset = fd_open_list[fd_index].offset;
-			file_size = fd_open_list[fd_index].file_size;
-			old_offset = offset;
-			break;
+
+	if (journal_reset()) {
+		printf("reset journal\n");
+		return EXIT_ERR;
+	}
+
+	return EXIT_NOERR;
+}
+
+/* writes in place the metadata as of the last commit, without the changes
+ * not committed yet, and empties the journal */
+static int checkpoint_committed(void)
+{
+	size_t i;
+
+	/* the blocks stay dirty, as they may hold uncommitted changes */
+	for (i = 0; i < superblock.fat_block_total; i++) {
+		if (fat_dirty[i] && write_fat_block(jcommit_fat, i)) {
+			printf("write fat\n");
+			return EXIT_ERR;
 		}
 	}
 
-	/* file fd not currently open */
-	if (fd_index < 0) {
+	if (root_dirty && write_root(jcommit_root)) {
+		printf("write root\n");
 		return EXIT_ERR;
 	}
 
-	if (offset > file_size) {
+	if (journal_reset()) {
+		printf("reset journal\n");
 		return EXIT_ERR;
 	}
-	
-	char *bounce_buffer = malloc(BLOCK_SIZE);
-	memset(bounce_buffer, 0, BLOCK_SIZE);
 
-	file_size -= (offset / BLOCK_SIZE) * BLOCK_SIZE;
+	return EXIT_NOERR;
+}
 
-	while (1) {
-		uint16_t tmp_offset = offset % BLOCK_SIZE;
-		block_index = find_block(fd, offset, &mode);
-		
-		/* data blocks are all full */
-		if (block_index == -1) {
-			break;
+/* encodes the uncommitted changes of FAT entries into @records from *@len on,
+ * up to @max bytes: of the entries freed if @freed, of the others otherwise;
+ * returns false if they did not all fit */
+static bool build_fat_records(uint8_t *records, size_t *len, size_t max,
+		bool freed)
+{
+	size_t j = 0, end, limit;
+	uint32_t start, value;
+	uint16_t count;
+
+	/* one record per run of changed FAT entries, holding their new values */
+	while (j < superblock.data_block_total) {
+		if (!jdirty_fat[j / 64]) {
+			j = (j / 64 + 1) * 64;
+			continue;
+		}
+		if (!(jdirty_fat[j / 64] & ((uint64_t)1 << (j % 64))) ||
+				(fatblock.block_table[j] == 0) != freed) {
+			j++;
+			continue;
 		}
 
-		/* read entire block from disk into bounce buffer */
-		if (block_read(block_index, bounce_buffer) == EXIT_ERR) {
-			return EXIT_ERR;
+		if (max - *len < JR_FAT_SIZE(1)) {
+			return false;
 		}
-	
-		/* write count bytes of data from buf and write whole buffer back to block */
-		if (tmp_offset + count > BLOCK_SIZE) {
-			memcpy(bounce_buffer + tmp_offset, 
-					buf + buf_offset, BLOCK_SIZE - tmp_offset);
-			block_write(block_index, bounce_buffer);
-			buf_offset += BLOCK_SIZE - tmp_offset;
-			bytes_written += BLOCK_SIZE - tmp_offset;
-			count -= BLOCK_SIZE - tmp_offset;
-			if (file_size > BLOCK_SIZE) {
-				file_size -= BLOCK_SIZE;
+		limit = (max - *len - JR_FAT_SIZE(0)) / sizeof(value);
+		if (limit > UINT16_MAX) {
+			limit = UINT16_MAX;
+		}
+
+		for (end = j; end < superblock.data_block_total &&
+				end - j < limit &&
+				(jdirty_fat[end / 64] & ((uint64_t)1 << (end % 64))) &&
+				(fatblock.block_table[end] == 0) == freed; end++) {
+			jdirty_fat[end / 64] &= ~((uint64_t)1 << (end % 64));
+		}
+		jdirty_fat_count -= end - j;
+
+		start = j;
+		count = end - j;
+		records[*len] = JR_FAT;
+		memcpy(records + *len + 1, &start, sizeof(start));
+		memcpy(records + *len + 5, &count, sizeof(count));
+		*len += JR_FAT_SIZE(0);
+		for (; j < end; j++) {
+			value = fat_to_disk(fatblock.block_table[j]);
+			memcpy(records + *len, &value, sizeof(value));
+			*len += sizeof(value);
+			jcommit_fat[j] = fatblock.block_table[j];
+		}
+	}
+
+	return true;
+}
+
+/* encodes uncommitted changes as journal records into @records, up to @max
+ * bytes of them, and returns their length; the changes encoded count as
+ * committed from then on */
+static size_t build_records(uint8_t *records, size_t max)
+{
+	size_t len = 0;
+	int i;
+
+	/* changes too many for a single commit are split in an order that
+	 * never leaves committed metadata pointing to free blocks: blocks
+	 * taken, then root directory entries, then blocks freed */
+	if (!build_fat_records(records, &len, max, false)) {
+		return len;
+	}
+
+	/* one record per changed root directory entry, holding the whole entry */
+	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (!jdirty_root[i]) {
+			continue;
+		}
+		if (max - len < JR_ROOT_SIZE) {
+			return len;
+		}
+		records[len] = JR_ROOT;
+		records[len + 1] = i;
+		encode_root(&rootdirectory[i], records + len + 2);
+		len += JR_ROOT_SIZE;
+		jdirty_root[i] = false;
+		jdirty_root_count--;
+		jcommit_root[i] = rootdirectory[i];
+	}
+
+	build_fat_records(records, &len, max, true);
+
+	return len;
+}
+
+/* returns the largest length of the records of the uncommitted changes */
+static size_t records_size(void)
+{
+	return jdirty_fat_count * JR_FAT_SIZE(1) +
+		jdirty_root_count * JR_ROOT_SIZE;
+}
+
+/* writes the uncommitted metadata changes to the journal as a single commit,
+ * or as several ones when they do not fit in an empty journal */
+static int commit_journal(void)
+{
+	uint8_t *records;
+	size_t len;
+	int ret = EXIT_NOERR;
+
+	if (!journal_on || (jdirty_fat_count == 0 && jdirty_root_count == 0)) {
+		journal_ops = 0;
+		__atomic_store_n(&commit_due, false, __ATOMIC_RELAXED);
+		return EXIT_NOERR;
+	}
+
+	/* data blocks reach the disk before the metadata pointing to them */
+	if (flush_all_stages() || cache_flush()) {
+		printf("flush cache\n");
+		return EXIT_ERR;
+	}
+
+	records = malloc(journal_capacity());
+	if (records == NULL) {
+		return EXIT_ERR;
+	}
+	journal_ops = 0;
+	__atomic_store_n(&commit_due, false, __ATOMIC_RELAXED);
+
+	while (ret == EXIT_NOERR &&
+			(jdirty_fat_count > 0 || jdirty_root_count > 0)) {
+		if (records_size() > journal_space() &&
+				journal_space() < journal_capacity()) {
+			/* make room without writing uncommitted changes in
+			 * place, which replaying the journal would not undo */
+			ret = checkpoint_committed();
+			continue;
+		}
+
+		len = build_records(records, journal_space());
+		if (journal_commit(records, len)) {
+			printf("write journal\n");
+			ret = EXIT_ERR;
+		}
+	}
+	free(records);
+
+	/* make room for the next commits, the metadata all committed */
+	if (ret == EXIT_NOERR && journal_space() < journal_capacity() / 2) {
+		ret = checkpoint_journal();
+	}
+
+	if (ret) {
+		/* the changes are still in memory: write them in place later */
+		super_dirty = true;
+		root_dirty = true;
+		memset(fat_dirty, 1, superblock.fat_block_total);
+	}
+
+	return ret;
+}
+
+/* counts a metadata changing operation, and flags the group of operations
+ * for commit when it is complete or when the journal would be too small for
+ * it; the commit itself needs the whole file system (see end_op()) */
+static void journal_op(void)
+{
+	bool due;
+
+	if (!journal_on) {
+		return;
+	}
+
+	pthread_mutex_lock(&root_lock);
+	pthread_mutex_lock(&alloc_lock);
+	due = ++journal_ops >= journal_group ||
+		records_size() >= journal_capacity() / 4;
+	pthread_mutex_unlock(&alloc_lock);
+	pthread_mutex_unlock(&root_lock);
+
+	if (due) {
+		__atomic_store_n(&commit_due, true, __ATOMIC_RELEASE);
+	}
+}
+
+/* applies the journal records of a commit to the in-memory metadata */
+static int replay_commit(const void *data, size_t len)
+{
+	const uint8_t *records = data;
+	size_t pos = 0, j;
+	uint32_t start, value;
+	uint16_t count;
+	uint8_t slot;
+
+	while (pos < len) {
+		if (records[pos] == JR_FAT && len - pos >= JR_FAT_SIZE(0)) {
+			memcpy(&start, records + pos + 1, sizeof(start));
+			memcpy(&count, records + pos + 5, sizeof(count));
+			pos += JR_FAT_SIZE(0);
+			if ((size_t)start + count > superblock.data_block_total ||
+					len - pos < 4 * (size_t)count) {
+				return EXIT_ERR;
 			}
-			else {
-				bytes_added += BLOCK_SIZE - file_size;
-				file_size = 0;
+			for (j = start; j < (size_t)start + count; j++) {
+				memcpy(&value, records + pos, sizeof(value));
+				set_fat(j, fat_from_disk(value));
+				pos += sizeof(value);
 			}
-			offset += BLOCK_SIZE - tmp_offset;
-		} else {
-			memcpy(bounce_buffer + tmp_offset, buf + buf_offset, count);
-			block_write(block_index, bounce_buffer);
-			if (count + tmp_offset > file_size) {
-				bytes_added += count + tmp_offset - file_size;
+		} else if (records[pos] == JR_ROOT && len - pos >= JR_ROOT_SIZE) {
+			slot = records[pos + 1];
+			if (slot >= FS_FILE_MAX_COUNT) {
+				return EXIT_ERR;
 			}
-			bytes_written += count;
-			offset += count;
-			break;
+			decode_root(&rootdirectory[slot], records + pos + 2);
+			root_dirty = true;
+			pos += JR_ROOT_SIZE;
+		} else {
+			return EXIT_ERR;
 		}
-		mode = WRITE_MODE;
 	}
 
-	int index = fd_open_list[fd_index].root_index;
-	rootdirectory[index].file_size += bytes_added;
-	fd_open_list[fd_index].offset = old_offset + bytes_written;
+	return EXIT_NOERR;
+}
+
+/* opens the journal of the disk, and replays and writes in place the changes
+ * it holds */
+static int recover_journal(void)
+{
+	int commits;
 
-	return bytes_written;
+	if (superblock.journal_index < superblock.data_index ||
+			superblock.journal_index + superblock.journal_block_total >
+			superblock.block_total ||
+			journal_open(superblock.journal_index,
+				superblock.journal_block_total)) {
+		return EXIT_ERR;
+	}
+
+	commits = journal_replay(replay_commit);
+	if (commits < 0 || (commits > 0 && sync_metadata()) || journal_reset()) {
+		journal_close();
+		return EXIT_ERR;
+	}
+
+	return EXIT_NOERR;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+/* builds free block bitmap and chain of each file from the FAT */
+static int build_alloc_state(void)
 {
+	size_t words = (superblock.data_block_total + 63) / 64;
+	uint32_t index;
 	int i;
-	int index = -1;	
-	uint16_t block_index;
-	int buf_offset = 0;
-	int mode = READ_MODE;
-	uint32_t offset, file_size = 0;
 
-	if (fd < 0) {
+	free_map = calloc(words, sizeof(uint64_t));
+	if (free_map == NULL) {
 		return EXIT_ERR;
 	}
+	free_hint = 0;
+	free_count = scan_free_entries(fatblock.block_table,
+			superblock.data_block_total, free_map);
 
-	/* get offset from fd */
-	for (i = 0; i < open_files; i++) {
-		if (fd_open_list[i].fd == fd) {
-			index = i;
-			offset = fd_open_list[index].offset;
-			file_size = rootdirectory[fd_open_list[index].root_index].file_size;
-			break;
+	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		chains[i].last_block = FAT_EOC;
+		chains[i].length = 0;
+		if (rootdirectory[i].filename[0] == '\0') {
+			continue;
+		}
+
+		/* bounded walk, in case of a corrupted chain */
+		index = rootdirectory[i].data_index;
+		while (index != FAT_EOC &&
+				chains[i].length < superblock.data_block_total) {
+			chains[i].last_block = index;
+			chains[i].length++;
+			index = fatblock.block_table[index];
 		}
 	}
 
-	/* file fd not currently open */
-	if (index < 0) {
-		return EXIT_ERR;
+	return EXIT_NOERR;
+}
+
+/* returns the first free data block at or after the hint, wrapping around,
+ * or -1 if the disk is full */
+static int find_free_block(void)
+{
+	size_t words = (superblock.data_block_total + 63) / 64;
+	size_t w, n, start = free_hint / 64;
+	uint64_t bits;
+
+	if (free_count == 0) {
+		return -1;
 	}
-	
-	char *bounce_buffer = malloc(BLOCK_SIZE);
-	memset(bounce_buffer, 0, BLOCK_SIZE);
 
-	while (1) {
-		block_index = find_block(fd, offset, &mode);
-		if (block_index == FAT_EOC) {
-			break;
-		}
-		uint16_t tmp_offset = offset % BLOCK_SIZE;
-		if (tmp_offset >= file_size) {
-			break;
+	for (n = 0; n <= words; n++) {
+		w = (start + n) % words;
+		bits = free_map[w];
+		/* ignore blocks before the hint in its own word, first time round */
+		if (n == 0) {
+			bits &= ~(uint64_t)0 << (free_hint % 64);
 		}
-		/* copy entire block from disk into bounce buffer */
-		if (block_read(block_index, bounce_buffer) == EXIT_ERR) {
-			return EXIT_ERR;
+		if (bits) {
+			return w * 64 + __builtin_ctzll(bits);
 		}
-	
-		/* copy desired bytes from bounce buffer into user supplied buffer */
-		if (tmp_offset + count > BLOCK_SIZE) {
-			if (file_size < BLOCK_SIZE) {
-				memcpy(buf + buf_offset, bounce_buffer + tmp_offset, 
-						file_size - tmp_offset);
-				buf_offset += file_size - tmp_offset;
-				offset += file_size - tmp_offset;
+	}
+
+	return -1;
+}
+
+/* marks data block @j allocated and terminates its chain */
+static void take_block(uint32_t j)
+{
+	set_fat(j, FAT_EOC);
+	free_map[j / 64] &= ~((uint64_t)1 << (j % 64));
+	free_count--;
+	free_hint = j + 1 < superblock.data_block_total ? j + 1 : 0;
+}
+
+/* marks data block @j free */
+static void release_block(uint32_t j)
+{
+	set_fat(j, 0);
+	free_map[j / 64] |= (uint64_t)1 << (j % 64);
+	free_count++;
+}
+
+/* looks for the first run of @count free data blocks, and returns its length
+ * and start in @start; if there is none, returns the longest run instead */
+static size_t find_free_run(size_t count, size_t *start)
+{
+	size_t words = (superblock.data_block_total + 63) / 64;
+	size_t w, b, n, run = 0, best = 0;
+	uint64_t bits;
+
+	/* walk the bitmap a stretch of equal bits at a time (the bits past the
+	 * last data block are clear) */
+	*start = 0;
+	for (w = 0; w < words; w++) {
+		b = 0;
+		while (b < 64) {
+			/* skip allocated blocks */
+			bits = free_map[w] >> b;
+			if (bits == 0) {
+				run = 0;
 				break;
 			}
-			else {
-				memcpy(buf + buf_offset, bounce_buffer + tmp_offset, 
-						BLOCK_SIZE - tmp_offset);
-				buf_offset += BLOCK_SIZE - tmp_offset;
-				count -= BLOCK_SIZE - tmp_offset;
-				file_size -= BLOCK_SIZE - tmp_offset;
-				offset += BLOCK_SIZE - tmp_offset;
+			n = __builtin_ctzll(bits);
+			if (n > 0) {
+				run = 0;
+				b += n;
+				bits >>= n;
 			}
-		} else {
-			if (tmp_offset + count > file_size) {
-				memcpy(buf + buf_offset, bounce_buffer + tmp_offset, 
-						file_size - tmp_offset);
-				buf_offset += file_size - tmp_offset;
-				offset += file_size - tmp_offset;
+
+			/* free blocks, extending the run of the previous
+			 * word if they start this one */
+			n = ~bits ? (size_t)__builtin_ctzll(~bits) : 64;
+			if (run + n >= count) {
+				*start = w * 64 + b - run;
+				return count;
 			}
-			else {
-				memcpy(buf + buf_offset, bounce_buffer + tmp_offset, count);
-				buf_offset += count;
-				offset += count;
+			run += n;
+			b += n;
+			if (run > best) {
+				best = run;
+				*start = w * 64 + b - run;
 			}
-			break;
 		}
 	}
 
-	fd_open_list[index].offset += buf_offset;
-	
-	return buf_offset;
+	return best;
+}
+
+/* sets up a journal of @count blocks in a free run of data blocks */
+static int create_journal(size_t count)
+{
+	size_t start, j;
+
+	if (count < 2 || find_free_run(count, &start) < count) {
+		return EXIT_ERR;
+	}
+
+	/* chain the blocks together, so that they are not seen as free */
+	for (j = start; j < start + count; j++) {
+		take_block(j);
+		if (j > start) {
+			set_fat(j - 1, j);
+		}
+	}
+	superblock.journal_index = start + superblock.data_index;
+	superblock.journal_block_total = count;
+	super_dirty = true;
+
+	if (journal_open(superblock.journal_index, count)) {
+		return EXIT_ERR;
+	}
+
+	/* the region may hold the blocks of an older journal, to be discarded
+	 * on disk before the superblock points to it */
+	if (journal_replay(NULL) < 0 || journal_reset() || sync_metadata()) {
+		journal_close();
+		return EXIT_ERR;
+	}
+
+	return EXIT_NOERR;
+}
+
+/* appends @count data blocks from @block to an extent map, at logical block
+ * @logical; returns the map, which may have moved, or NULL if it could not
+ * grow (the map is then freed) */
+static struct extent_map *add_extent(struct extent_map *map, size_t logical,
+		uint32_t block, size_t count)
+{
+	struct extent_map *grown;
+	struct extent *last = map->count ? &map->extents[map->count - 1] : NULL;
+
+	if (last != NULL && last->block + last->length == block &&
+			last->length + count <= UINT32_MAX) {
+		last->length += count;
+		return map;
+	}
+
+	if (map->count == map->capacity) {
+		grown = realloc(map, sizeof(*map) +
+				2 * map->capacity * sizeof(*map->extents));
+		if (grown == NULL) {
+			free(map);
+			return NULL;
+		}
+		map = grown;
+		map->capacity *= 2;
+	}
+
+	map->extents[map->count].logical = logical;
+	map->extents[map->count].block = block;
+	map->extents[map->count].length = count;
+	map->count++;
+
+	return map;
+}
+
+/* records that @count data blocks from @block were appended to file @i's
+ * chain, in its extent map if it has one (under the file's write lock) */
+static void extend_extents(int i, uint32_t block, size_t count)
+{
+	if (extent_maps[i] != NULL) {
+		extent_maps[i] = add_extent(extent_maps[i], chains[i].length,
+				block, count);
+	}
+}
+
+/* drops file @i's extent map, to be built again when next needed */
+static void drop_extents(int i)
+{
+	free(extent_maps[i]);
+	extent_maps[i] = NULL;
+}
+
+/* adds one zeroed block to file's delayed blocks, taken from the free space */
+static bool reserve_block(int i)
+{
+	struct pending *p = &pending[i];
+	size_t capacity;
+	char *data;
+
+	if (p->nblocks == p->capacity) {
+		capacity = p->capacity ? 2 * p->capacity : 16;
+		data = realloc(p->data, capacity * BLOCK_SIZE);
+		if (data == NULL) {
+			return false;
+		}
+		p->data = data;
+		p->capacity = capacity;
+	}
+
+	pthread_mutex_lock(&alloc_lock);
+	if (free_count == reserved_count) {
+		pthread_mutex_unlock(&alloc_lock);
+		return false;
+	}
+	reserved_count++;
+	pthread_mutex_unlock(&alloc_lock);
+
+	memset(p->data + p->nblocks * BLOCK_SIZE, 0, BLOCK_SIZE);
+	p->nblocks++;
+
+	return true;
+}
+
+/* allocates file's delayed blocks, as contiguously as possible, and writes
+ * them to disk */
+static int flush_pending(int i)
+{
+	struct pending *p = &pending[i];
+	size_t done = 0, run, start, j;
+
+	while (done < p->nblocks) {
+		/* take the run out of the free space while it gets written */
+		pthread_mutex_lock(&alloc_lock);
+		run = find_free_run(p->nblocks - done, &start);
+		for (j = start; j < start + run; j++) {
+			take_block(j);
+		}
+		reserved_count -= run;
+		pthread_mutex_unlock(&alloc_lock);
+
+		if (cache_write_range(start + superblock.data_index, run,
+					p->data + done * BLOCK_SIZE)) {
+			pthread_mutex_lock(&alloc_lock);
+			for (j = start; j < start + run; j++) {
+				release_block(j);
+			}
+			reserved_count += run;
+			pthread_mutex_unlock(&alloc_lock);
+			break;
+		}
+
+		/* link the run at the end of file's chain */
+		if (chains[i].last_block == FAT_EOC) {
+			pthread_mutex_lock(&root_lock);
+			rootdirectory[i].data_index = start;
+			mark_root(i);
+			pthread_mutex_unlock(&root_lock);
+		}
+		pthread_mutex_lock(&alloc_lock);
+		for (j = start; j < start + run; j++) {
+			if (j > start) {
+				set_fat(j - 1, j);
+			} else if (chains[i].last_block != FAT_EOC) {
+				set_fat(chains[i].last_block, j);
+			}
+		}
+		pthread_mutex_unlock(&alloc_lock);
+		extend_extents(i, start, run);
+		chains[i].last_block = start + run - 1;
+		chains[i].length += run;
+		stat_add(&stats.blocks_allocated, run);
+		done += run;
+	}
+
+	if (done < p->nblocks) {
+		/* keep what could not be written for a later attempt */
+		memmove(p->data, p->data + done * BLOCK_SIZE,
+				(p->nblocks - done) * BLOCK_SIZE);
+		p->nblocks -= done;
+		return EXIT_ERR;
+	}
+
+	free(p->data);
+	p->data = NULL;
+	p->nblocks = 0;
+	p->capacity = 0;
+
+	return EXIT_NOERR;
+}
+
+static int flush_all_pending(void)
+{
+	int i, ret = EXIT_NOERR;
+
+	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (pending[i].nblocks && flush_pending(i)) {
+			ret = EXIT_ERR;
+		}
+	}
+
+	return ret;
+}
+
+/* releases the in-memory state of the mounted file system, and brings the
+ * module back to its state before the first mount */
+static void free_state(void)
+{
+	size_t slot;
+	int i;
+
+	for (slot = 0; fd_locks && slot < fd_table_size; slot++) {
+		pthread_mutex_destroy(&fd_locks[slot]);
+	}
+
+	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		drop_extents(i);
+		free(pending[i].data);
+	}
+	memset(pending, 0, sizeof(pending));
+	memset(chains, 0, sizeof(chains));
+	memset(chain_gens, 0, sizeof(chain_gens));
+	memset(move_count, 0, sizeof(move_count));
+	memset(open_count, 0, sizeof(open_count));
+	memset(stage_list, 0, sizeof(stage_list));
+	clear_name_index();
+
+	free(table);
+	free(fat_dirty);
+	free(free_map);
+	free(fd_table);
+	free(fd_locks);
+	free(fd_free_slots);
+	free(jdirty_fat);
+	free(jcommit_fat);
+	table = NULL;
+	fat_dirty = NULL;
+	free_map = NULL;
+	fd_table = NULL;
+	fd_locks = NULL;
+	fd_table_size = 0;
+	fd_free_slots = NULL;
+	fd_slot_count = 0;
+	fd_slot_bits = 0;
+	open_files = 0;
+	jdirty_fat = NULL;
+	jcommit_fat = NULL;
+	fatblock.block_table = NULL;
+
+	/* nothing of the disk is left in memory */
+	memset(&superblock, 0, sizeof(superblock));
+	memset(rootdirectory, 0, sizeof(rootdirectory));
+	memset(jcommit_root, 0, sizeof(jcommit_root));
+	memset(jdirty_root, 0, sizeof(jdirty_root));
+	jdirty_fat_count = 0;
+	jdirty_root_count = 0;
+	journal_ops = 0;
+	commit_due = false;
+	fat_per_block = 0;
+	root_dirty = false;
+	super_dirty = false;
+	free_hint = 0;
+	free_count = 0;
+	reserved_count = 0;
+	defrag_next = 0;
+	delay_alloc = false;
+	aio_on = false;
+
+	if (journal_on) {
+		journal_close();
+		journal_on = false;
+	}
+
+	if (fanout_threads > 1) {
+		pool_stop();
+		fanout_threads = 1;
+	}
+}
+
+int fs_mount(const char *diskname)
+{
+	return fs_mount_opts(diskname, NULL);
+}
+
+static int do_mount(const char *diskname, const struct fs_options *opts)
+{
+	size_t cache_blocks = opts ? opts->cache_blocks : FS_CACHE_BLOCKS;
+	size_t open_max = opts && opts->open_max ? opts->open_max :
+		FS_OPEN_MAX_COUNT;
+	unsigned int io_depth = opts ? opts->io_depth : FS_IO_DEPTH;
+	unsigned int read_threads = opts ? opts->read_threads : FS_READ_THREADS;
+	int flags = opts && opts->map_disk ? BLOCK_DISK_MMAP : 0;
+	bool has_journal;
+
+	delay_alloc = opts && opts->delay_alloc;
+	reserved_count = 0;
+	defrag_next = 0;
+	journal_group = opts && opts->journal_group ? opts->journal_group :
+		FS_JOURNAL_GROUP;
+
+	/* too many open files requested */
+	if (open_max > FS_OPEN_MAX_LIMIT) {
+		printf("open max\n");
+		return EXIT_ERR;
+	}
+
+	/* disk cannot be opened */
+	if (block_disk_open_flags(diskname, flags)) {
+		printf("diskname\n");
+		return EXIT_ERR;
+	}	
+	
+	/* the signature of the superblock tells the format of the disk */
+	if (read_super()) {
+		printf("read super\n");
+		block_disk_close();
+		return EXIT_ERR;
+	}
+	
+	/* the in-memory FAT has 32-bit entries, whatever the format */
+	table = malloc((size_t)superblock.fat_block_total * fat_per_block *
+			sizeof(uint32_t));
+	fatblock.block_table = table;
+	fat_dirty = calloc(superblock.fat_block_total, 1);
+	root_dirty = false;
+	super_dirty = false;
+	
+	for (size_t i = 0; i < superblock.fat_block_total; i++) {
+		if (read_fat_block(i)) {
+			printf("read fat\n");
+			free_state();
+			block_disk_close();
+			return EXIT_ERR;
+		}
+	}
+	
+	if (read_root()) {
+		printf("read root\n");
+		free_state();
+		block_disk_close();
+		return EXIT_ERR;
+	}
+
+	/* redo the metadata changes of the last mount that were only written to
+	 * the journal */
+	has_journal = superblock.journal_block_total > 0;
+	if (has_journal && recover_journal()) {
+		printf("journal\n");
+		free_state();
+		block_disk_close();
+		return EXIT_ERR;
+	}
+
+	build_name_index();
+
+	if (build_alloc_state()) {
+		printf("alloc state\n");
+		if (has_journal) {
+			journal_close();
+		}
+		free_state();
+		block_disk_close();
+		return EXIT_ERR;
+	}
+
+	if (!has_journal && opts && opts->journal_blocks > 0) {
+		if (create_journal(opts->journal_blocks)) {
+			printf("create journal\n");
+			free_state();
+			block_disk_close();
+			return EXIT_ERR;
+		}
+		has_journal = true;
+	}
+
+	/* from now on, metadata changes get journaled */
+	if (has_journal) {
+		journal_on = true;
+		commit_due = false;
+		journal_ops = 0;
+		jdirty_fat_count = 0;
+		jdirty_root_count = 0;
+		memset(jdirty_root, 0, sizeof(jdirty_root));
+		jdirty_fat = calloc((superblock.data_block_total + 63) / 64,
+				sizeof(uint64_t));
+		jcommit_fat = malloc((size_t)superblock.fat_block_total *
+				fat_per_block * sizeof(uint32_t));
+		if (jdirty_fat == NULL || jcommit_fat == NULL) {
+			printf("journal state\n");
+			free_state();
+			block_disk_close();
+			return EXIT_ERR;
+		}
+		memcpy(jcommit_fat, table, (size_t)superblock.fat_block_total *
+				fat_per_block * sizeof(uint32_t));
+		memcpy(jcommit_root, rootdirectory, sizeof(jcommit_root));
+	}
+
+	if (build_fd_table(open_max)) {
+		printf("fd table\n");
+		free_state();
+		block_disk_close();
+		return EXIT_ERR;
+	}
+
+	if (cache_open(cache_blocks)) {
+		printf("cache\n");
+		free_state();
+		block_disk_close();
+		return EXIT_ERR;
+	}
+
+	/* falls back to synchronous requests without io_uring */
+	aio_on = io_depth > 1 && !block_aio_open(io_depth);
+
+	/* falls back to reading on the calling thread only without workers */
+	fanout_threads = read_threads > 1 && !pool_start(read_threads - 1) ?
+		read_threads : 1;
+	
+	file_system_open = true;
+	return EXIT_NOERR;
+}
+
+static int do_format(const char *diskname, int format)
+{
+	char block[BLOCK_SIZE];
+	size_t count, per_block, fat_blocks, i;
+	int ret = EXIT_NOERR;
+
+	if (file_system_open) {
+		printf("mounted\n");
+		return EXIT_ERR;
+	}
+
+	if (format != FS_FORMAT_FAT16 && format != FS_FORMAT_FAT32) {
+		printf("format\n");
+		return EXIT_ERR;
+	}
+
+	if (block_disk_open(diskname)) {
+		printf("diskname\n");
+		return EXIT_ERR;
+	}
+
+	/* superblock, one FAT entry per data block, root directory, and at
+	 * least one data block past the reserved first one */
+	count = block_disk_count();
+	per_block = BLOCK_SIZE / fat_entry_size(format);
+	fat_blocks = count > 2 ? (count - 2 + per_block) / (per_block + 1) : 0;
+	if (count < 4 || (format == FS_FORMAT_FAT16 && count > UINT16_MAX)) {
+		printf("disk size\n");
+		block_disk_close();
+		return EXIT_ERR;
+	}
+
+	memset(&superblock, 0, sizeof(superblock));
+	superblock.version = format;
+	superblock.block_total = count;
+	superblock.root_index = fat_blocks + 1;
+	superblock.data_index = fat_blocks + 2;
+	superblock.data_block_total = count - fat_blocks - 2;
+	superblock.fat_block_total = fat_blocks;
+
+	if (write_super()) {
+		printf("write super\n");
+		ret = EXIT_ERR;
+	}
+
+	/* every data block is free, but the first one, whose entry holds the
+	 * end of chain marker (all bits set in both formats) */
+	memset(block, 0, BLOCK_SIZE);
+	memset(block, 0xFF, fat_entry_size(format));
+	for (i = 0; ret == EXIT_NOERR && i < fat_blocks; i++) {
+		if (block_write(i + 1, block)) {
+			printf("write fat\n");
+			ret = EXIT_ERR;
+		}
+		memset(block, 0, fat_entry_size(format));
+	}
+
+	memset(block, 0, BLOCK_SIZE);
+	if (ret == EXIT_NOERR && block_write(superblock.root_index, block)) {
+		printf("write root\n");
+		ret = EXIT_ERR;
+	}
+
+	if (block_disk_close()) {
+		printf("no file open\n");
+		ret = EXIT_ERR;
+	}
+
+	return ret;
+}
+
+static int do_sync(void)
+{
+	if (!file_system_open) {
+		return EXIT_ERR;
+	}
+
+	/* write staged writes, then allocate and write delayed blocks */
+	if (flush_all_stages() || flush_all_pending()) {
+		printf("flush delayed\n");
+		return EXIT_ERR;
+	}
+
+	/* write back cached data blocks before the metadata pointing to them */
+	if (cache_flush()) {
+		printf("flush cache\n");
+		return EXIT_ERR;
+	}
+
+	if (journal_on) {
+		return commit_journal();
+	}
+
+	return sync_metadata();
+}
+
+static int do_umount(void)
+{
+	/* still open file descriptors */
+	if (open_files) {
+		printf("open file descriptors\n");
+		return EXIT_ERR;
+	}
+
+	/* write back delayed and cached data, then changed metadata */
+	if (do_sync()) {
+		return EXIT_ERR;
+	}
+
+	/* leave the journal empty */
+	if (journal_on && checkpoint_journal()) {
+		return EXIT_ERR;
+	}
+
+	if (cache_close()) {
+		printf("close cache\n");
+		return EXIT_ERR;
+	}
+
+	/* close underlying virtual disk file */
+	if (block_disk_close()) {
+		printf("no file open\n");
+		return EXIT_ERR;
+	}
+
+	free_state();
+	file_system_open = false;
+	
+	return EXIT_NOERR;
+}
+
+static int do_info(void)
+{
+	int i, count = 0;
+	if (!file_system_open) {
+		printf("file\n");
+		return EXIT_ERR;
+	}
+	
+	printf("FS Info:\n");
+	printf("total_blk_count=%u\n", superblock.block_total);
+	printf("fat_blk_count=%u\n", superblock.fat_block_total);
+	printf("rdir_blk=%u\n", superblock.root_index);
+	printf("data_blk=%u\n", superblock.data_index);
+	printf("data_blk_count=%u\n", superblock.data_block_total);
+	
+	printf("fat_free_ratio=%zu/%u\n", free_count - reserved_count,
+			superblock.data_block_total);
+	
+	count = 0;
+	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdirectory[i].data_index == 0) {
+			count++;
+		}
+	}
+	
+	printf("rdir_free_ratio=%d/%d\n", count, FS_FILE_MAX_COUNT);
+	
+	return EXIT_NOERR;
+}
+
+/* reports the superblock fields that do not match the geometry of the disk;
+ * returns the number of problems, or -1 if the FAT cannot be trusted */
+static int check_super(void)
+{
+	size_t fat_blocks = (superblock.data_block_total + fat_per_block - 1) /
+		fat_per_block;
+	int problems = 0;
+
+	if (superblock.block_total != (uint32_t)block_disk_count() ||
+			superblock.block_total != superblock.data_index +
+			superblock.data_block_total) {
+		printf("check: superblock: %u blocks, disk has %d\n",
+				superblock.block_total, block_disk_count());
+		problems++;
+	}
+	if (superblock.root_index != superblock.fat_block_total + 1 ||
+			superblock.data_index != superblock.root_index + 1) {
+		printf("check: superblock: root at %u, data at %u\n",
+				superblock.root_index, superblock.data_index);
+		problems++;
+	}
+	if (superblock.journal_block_total > 0 &&
+			(superblock.journal_index < superblock.data_index ||
+			 superblock.journal_index +
+			 superblock.journal_block_total >
+			 superblock.data_index + superblock.data_block_total)) {
+		printf("check: superblock: journal outside of data blocks\n");
+		return EXIT_ERR;
+	}
+	if (fat_blocks > superblock.fat_block_total) {
+		printf("check: superblock: %u FAT blocks for %u data blocks\n",
+				superblock.fat_block_total,
+				superblock.data_block_total);
+		return EXIT_ERR;
+	}
+
+	return problems;
+}
+
+static bool valid_block(uint32_t j)
+{
+	return j != 0 && j < superblock.data_block_total &&
+		fatblock.block_table[j] != 0;
+}
+
+/* gives data block @j to @owner in the reachability map, unless an owner of
+ * higher priority already has it */
+static void claim_block(uint8_t *owner, uint32_t j, uint8_t who)
+{
+	uint8_t cur = __atomic_load_n(&owner[j], __ATOMIC_RELAXED);
+
+	while ((cur == OWNER_NONE || cur > who) &&
+			!__atomic_compare_exchange_n(&owner[j], &cur, who, true,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* walks the chains of a part of the files, up to their first invalid or
+ * repeated block, and claims their blocks */
+static int check_walk(void *arg, size_t part)
+{
+	struct check *check = arg;
+	struct check_chain *c;
+	uint64_t *seen, bit;
+	uint32_t index;
+	size_t i, n;
+
+	/* blocks seen in the chain being walked */
+	seen = calloc((superblock.data_block_total + 63) / 64,
+			sizeof(uint64_t));
+	if (seen == NULL) {
+		return EXIT_ERR;
+	}
+
+	for (i = part; i < FS_FILE_MAX_COUNT; i += check->parts) {
+		if (rootdirectory[i].filename[0] == '\0') {
+			continue;
+		}
+
+		c = &check->chains[i];
+		index = rootdirectory[i].data_index;
+		while (index != FAT_EOC) {
+			bit = (uint64_t)1 << (index % 64);
+			if (!valid_block(index)) {
+				c->broken = true;
+				break;
+			}
+			if (seen[index / 64] & bit) {
+				c->cycle = true;
+				break;
+			}
+			seen[index / 64] |= bit;
+			claim_block(check->owner, index, OWNER_FILE(i));
+			c->length++;
+			index = fatblock.block_table[index];
+		}
+
+		/* only the words holding the chain's blocks have bits set */
+		index = rootdirectory[i].data_index;
+		for (n = 0; n < c->length; n++) {
+			seen[index / 64] = 0;
+			index = fatblock.block_table[index];
+		}
+	}
+
+	free(seen);
+	return EXIT_NOERR;
+}
+
+/* finds where the chains of a part of the files reach blocks owned by the
+ * journal or another file */
+static int check_share(void *arg, size_t part)
+{
+	struct check *check = arg;
+	struct check_chain *c;
+	uint32_t index;
+	size_t i, n;
+
+	for (i = part; i < FS_FILE_MAX_COUNT; i += check->parts) {
+		c = &check->chains[i];
+		c->shared_at = c->length;
+		index = rootdirectory[i].data_index;
+		for (n = 0; n < c->length; n++) {
+			if (check->owner[index] != OWNER_FILE(i)) {
+				c->shared_at = n;
+				c->shared_with = check->owner[index];
+				break;
+			}
+			index = fatblock.block_table[index];
+		}
+	}
+
+	return EXIT_NOERR;
+}
+
+/* reports the journal blocks that are not chained together, and fixes them if
+ * @repair is set (under alloc_lock); returns the number of problems */
+static int check_journal(struct check *check, bool repair)
+{
+	size_t start, end, j;
+	uint32_t next;
+	int problems = 0;
+
+	if (superblock.journal_block_total == 0) {
+		return 0;
+	}
+
+	start = superblock.journal_index - superblock.data_index;
+	end = start + superblock.journal_block_total;
+	for (j = start; j < end; j++) {
+		check->owner[j] = OWNER_JOURNAL;
+		next = j + 1 < end ? j + 1 : FAT_EOC;
+		if (fatblock.block_table[j] != next) {
+			problems++;
+			if (repair) {
+				set_fat(j, next);
+			}
+		}
+	}
+
+	if (problems) {
+		printf("check: journal: %d blocks not chained\n", problems);
+	}
+
+	return problems;
+}
+
+/* cuts file @i's chain after its first @keep blocks, and frees the @drop
+ * blocks that follow (under root_lock and alloc_lock) */
+static void cut_chain(struct check *check, int i, size_t keep, size_t drop)
+{
+	uint32_t index = rootdirectory[i].data_index, next;
+	size_t n;
+
+	for (n = 0; n < keep + drop; n++) {
+		next = fatblock.block_table[index];
+		if (n + 1 == keep) {
+			set_fat(index, FAT_EOC);
+		} else if (n >= keep) {
+			set_fat(index, 0);
+			check->owner[index] = OWNER_NONE;
+		}
+		index = next;
+	}
+
+	if (keep == 0) {
+		rootdirectory[i].data_index = FAT_EOC;
+	}
+	mark_root(i);
+}
+
+/* reports the problems of file @i's chain, and fixes them if @repair is set
+ * (under root_lock and alloc_lock); returns the number of problems */
+static int check_file(struct check *check, int i, bool repair)
+{
+	struct check_chain *c = &check->chains[i];
+	const char *name = rootdirectory[i].filename;
+	uint32_t size = rootdirectory[i].file_size;
+	size_t needed = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t keep = c->shared_at < needed ? c->shared_at : needed;
+	int problems = 0;
+
+	if (c->broken) {
+		printf("check: file %s: invalid block after %zu blocks\n",
+				name, c->length);
+		problems++;
+	}
+	if (c->cycle) {
+		printf("check: file %s: cycle after %zu blocks\n", name,
+				c->length);
+		problems++;
+	}
+	if (c->shared_at < c->length) {
+		printf("check: file %s: blocks shared with %s after %zu "
+				"blocks\n", name,
+				c->shared_with == OWNER_JOURNAL ? "the journal" :
+				rootdirectory[c->shared_with - 2].filename,
+				c->shared_at);
+		problems++;
+	}
+	if (c->shared_at != needed) {
+		printf("check: file %s: %u bytes in %zu blocks\n", name, size,
+				c->shared_at);
+		problems++;
+	}
+
+	if (problems && repair) {
+		cut_chain(check, i, keep, c->shared_at - keep);
+		if (size > keep * BLOCK_SIZE) {
+			rootdirectory[i].file_size = keep * BLOCK_SIZE;
+		}
+	}
+
+	return problems;
+}
+
+/* reports the data blocks in use that no chain reaches, and frees them if
+ * @repair is set (under alloc_lock); returns the number of problems */
+static int check_leaks(struct check *check, bool repair)
+{
+	size_t j, leaked = 0;
+	int problems = 0;
+
+	/* the first FAT entry is never a data block */
+	if (fatblock.block_table[0] != FAT_EOC) {
+		printf("check: FAT entry 0 is %u\n",
+				fat_to_disk(fatblock.block_table[0]));
+		problems++;
+		if (repair) {
+			set_fat(0, FAT_EOC);
+		}
+	}
+
+	for (j = 1; j < superblock.data_block_total; j++) {
+		if (fatblock.block_table[j] != 0 &&
+				check->owner[j] == OWNER_NONE) {
+			leaked++;
+			if (repair) {
+				set_fat(j, 0);
+			}
+		}
+	}
+
+	if (leaked) {
+		printf("check: %zu leaked blocks\n", leaked);
+		problems++;
+	}
+
+	return problems;
+}
+
+static int do_check(bool repair)
+{
+	struct check check;
+	int i, ret, problems;
+
+	if (!file_system_open) {
+		printf("file\n");
+		return EXIT_ERR;
+	}
+
+	/* repairs would move chains under open descriptors */
+	if (repair && open_files) {
+		printf("open file descriptors\n");
+		return EXIT_ERR;
+	}
+
+	problems = check_super();
+	if (problems < 0) {
+		return EXIT_ERR;
+	}
+
+	/* delayed and staged data must be in the chains */
+	if (flush_all_stages() || flush_all_pending()) {
+		printf("flush delayed\n");
+		return EXIT_ERR;
+	}
+
+	memset(&check, 0, sizeof(check));
+	check.parts = fanout_threads;
+	check.owner = calloc(superblock.data_block_total, 1);
+	if (check.owner == NULL) {
+		return EXIT_ERR;
+	}
+
+	/* the journal claims its blocks first, then the files walk their
+	 * chains in parallel */
+	pthread_mutex_lock(&root_lock);
+	pthread_mutex_lock(&alloc_lock);
+	problems += check_journal(&check, repair);
+	if (pool_run(check_walk, &check, check.parts) ||
+			pool_run(check_share, &check, check.parts)) {
+		pthread_mutex_unlock(&alloc_lock);
+		pthread_mutex_unlock(&root_lock);
+		free(check.owner);
+		return EXIT_ERR;
+	}
+
+	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdirectory[i].filename[0] != '\0') {
+			problems += check_file(&check, i, repair);
+		}
+	}
+	problems += check_leaks(&check, repair);
+	pthread_mutex_unlock(&alloc_lock);
+	pthread_mutex_unlock(&root_lock);
+	free(check.owner);
+
+	if (!repair || problems == 0) {
+		return problems;
+	}
+
+	/* start over from the repaired FAT, and write it back */
+	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		drop_extents(i);
+	}
+	free(free_map);
+	ret = build_alloc_state();
+	if (ret == EXIT_NOERR) {
+		ret = do_sync();
+	}
+
+	return ret ? EXIT_ERR : problems;
+}
+
+static int do_create(const char *filename)
+{
+	stat_add(&stats.create_calls, 1);
+
+	/* filename invalid */
+	if (filename == NULL) {
+		return EXIT_ERR;
+	}
+
+	/* filename too long */
+	if (strlen(filename) >= FS_FILENAME_LEN) {
+		return EXIT_ERR;
+	}
+
+	pthread_mutex_lock(&root_lock);
+
+	/* check if file already exists */
+	int i;
+	if (filename[0] == '\0' || find_file(filename) != NO_FILE) {
+		pthread_mutex_unlock(&root_lock);
+		return EXIT_ERR;
+	}
+
+	/* find empty entry in root directory */
+	int empty = -1;
+	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdirectory[i].filename[0] == '\0') {
+			/* empty */
+			empty = i;
+			break;
+		}
+	}
+
+	/* root directory is full */
+	if (empty < 0) {
+		pthread_mutex_unlock(&root_lock);
+		return EXIT_ERR;
+	}
+
+	strcpy(rootdirectory[empty].filename, filename);
+	index_file(empty);
+	rootdirectory[empty].file_size = 0;
+	rootdirectory[empty].data_index = FAT_EOC;
+	mark_root(empty);
+	chains[empty].last_block = FAT_EOC;
+	chains[empty].length = 0;
+
+	pthread_mutex_unlock(&root_lock);
+	journal_op();
+
+	return EXIT_NOERR;
+}
+
+static int do_delete(const char *filename)
+{
+	stat_add(&stats.delete_calls, 1);
+
+	/* filename invalid */
+	if (filename == NULL) {
+		return EXIT_ERR;
+	}
+
+	pthread_mutex_lock(&root_lock);
+
+	/* find the file, once fs_defrag() is done moving it */
+	int file_index = find_file(filename);
+	while (file_index >= 0 && move_count[file_index] > 0) {
+		pthread_mutex_unlock(&root_lock);
+		pthread_rwlock_wrlock(&file_locks[file_index]);
+		pthread_rwlock_unlock(&file_locks[file_index]);
+		pthread_mutex_lock(&root_lock);
+		file_index = find_file(filename);
+	}
+	
+	/* no file filename to delete */
+	if (file_index < 0) {
+		pthread_mutex_unlock(&root_lock);
+		return EXIT_ERR;
+	}
+
+	/* file is still open */
+	if (open_count[file_index] > 0) {
+		pthread_mutex_unlock(&root_lock);
+		return EXIT_ERR;
+	}
+
+	/* free all data blocks containing file's contents in the FAT */
+	pthread_mutex_lock(&alloc_lock);
+	uint32_t old_index, next_index = rootdirectory[file_index].data_index;
+	while (next_index != FAT_EOC) {
+		old_index = next_index;
+		next_index = fatblock.block_table[next_index];
+		release_block(old_index);
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	chains[file_index].last_block = FAT_EOC;
+	chains[file_index].length = 0;
+	drop_extents(file_index);
+
+	/* empty file's entry */
+	unindex_file(file_index);
+	rootdirectory[file_index].filename[0] = '\0';
+	rootdirectory[file_index].file_size = 0;
+	rootdirectory[file_index].data_index = 0;
+	mark_root(file_index);
+
+	pthread_mutex_unlock(&root_lock);
+	journal_op();
+
+	return EXIT_NOERR;
+}
+
+static int do_ls(void)
+{
+	printf("FS Ls:\n");
+
+	/* no underlying virtual disk open */
+	if (!file_system_open) {
+		return EXIT_ERR;
+	}
+	
+	int i;
+	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdirectory[i].filename[0] != '\0') {
+			printf("file: %s, size: %u, data_blk: %u\n",
+					rootdirectory[i].filename,
+					rootdirectory[i].file_size,
+					fat_to_disk(rootdirectory[i].data_index));
+		}
+	}
+	
+	return EXIT_NOERR;
+}
+
+static int do_open(const char *filename)
+{
+	int root_index = -1;
+	struct file_descriptor *file_des;
+	uint16_t slot;
+	int fd;
+
+	stat_add(&stats.open_calls, 1);
+
+	if (filename == NULL) {
+		return EXIT_ERR;
+	}
+
+	/* an open file cannot be deleted */
+	pthread_mutex_lock(&root_lock);
+	root_index = find_file(filename);
+	if (root_index >= 0) {
+		open_count[root_index] += 1;
+	}
+	pthread_mutex_unlock(&root_lock);
+
+	if (root_index < 0) {
+		return EXIT_ERR;
+	}
+
+	pthread_mutex_lock(&fd_table_lock);
+	if (open_files == (int)fd_slot_count) {
+		pthread_mutex_unlock(&fd_table_lock);
+		pthread_mutex_lock(&root_lock);
+		open_count[root_index] -= 1;
+		pthread_mutex_unlock(&root_lock);
+		return EXIT_ERR;
+	}
+	slot = fd_free_slots[fd_slot_count - 1 - open_files];
+	open_files += 1;
+	pthread_mutex_unlock(&fd_table_lock);
+	
+	pthread_mutex_lock(&fd_locks[slot]);
+	file_des = &fd_table[slot];
+	fd = file_des->generation << fd_slot_bits | slot;
+	file_des->fd = fd;
+	file_des->open = true;
+	file_des->offset = 0;
+	file_des->root_index = root_index;
+	file_des->cur_block = 0;
+	file_des->cur_index = FAT_EOC;
+	file_des->ra_next = 0;
+	file_des->ra_end = 0;
+	file_des->ra_window = 0;
+	file_des->stage = NULL;
+	file_des->stage_start = 0;
+	file_des->stage_end = 0;
+	file_des->stage_next = NULL;
+	pthread_mutex_unlock(&fd_locks[slot]);
+
+	return fd;
+}
+
+static int do_close(int fd)
+{
+	struct file_descriptor *file_des;
+	bool retire;
+	int i;
+
+	stat_add(&stats.close_calls, 1);
+
+	if (fd < 0) {
+		return EXIT_ERR;
+	}
+
+	file_des = lock_fd(fd);
+
+	/* file fd not currently open */
+	if (file_des == NULL) {
+		return EXIT_ERR;
+	}
+	i = file_des->root_index;
+
+	/* write staged writes, then allocate and write delayed blocks */
+	pthread_rwlock_wrlock(&file_locks[i]);
+	if (flush_stage(file_des) || flush_pending(i)) {
+		pthread_rwlock_unlock(&file_locks[i]);
+		unlock_fd(file_des);
+		return EXIT_ERR;
+	}
+	free(file_des->stage);
+	file_des->stage = NULL;
+	pthread_rwlock_unlock(&file_locks[i]);
+
+	/* stale copies of fd get rejected once the slot is reused, which it is
+	 * not anymore past its last generation */
+	file_des->open = false;
+	retire = file_des->generation == fd_generation_max();
+	if (!retire) {
+		file_des->generation++;
+	}
+	unlock_fd(file_des);
+
+	pthread_mutex_lock(&root_lock);
+	open_count[i] -= 1;
+	pthread_mutex_unlock(&root_lock);
+
+	pthread_mutex_lock(&fd_table_lock);
+	open_files -= 1;
+	if (retire) {
+		fd_slot_count -= 1;
+	} else {
+		fd_free_slots[fd_slot_count - 1 - open_files] =
+			fd & ((1 << fd_slot_bits) - 1);
+	}
+	pthread_mutex_unlock(&fd_table_lock);
+
+	journal_op();
+
+	return EXIT_NOERR;
+}
+
+static int do_flush(int fd)
+{
+	struct file_descriptor *file_des;
+	int i, ret = EXIT_NOERR;
+
+	if (fd < 0) {
+		return EXIT_ERR;
+	}
+
+	file_des = lock_fd(fd);
+
+	/* file fd not currently open */
+	if (file_des == NULL) {
+		return EXIT_ERR;
+	}
+	i = file_des->root_index;
+
+	pthread_rwlock_wrlock(&file_locks[i]);
+	if (flush_stage(file_des) || flush_pending(i)) {
+		ret = EXIT_ERR;
+	}
+	pthread_rwlock_unlock(&file_locks[i]);
+	unlock_fd(file_des);
+
+	if (ret == EXIT_NOERR) {
+		journal_op();
+	}
+
+	return ret;
+}
+
+static int do_stat(int fd)
+{
+	struct file_descriptor *file_des;
+	int i, size;
+
+	stat_add(&stats.stat_calls, 1);
+
+	if (fd < 0) {
+		return EXIT_ERR;
+	}
+	
+	file_des = lock_fd(fd);
+
+	/* file fd not currently open */
+	if (file_des == NULL) {
+		return EXIT_ERR;
+	}
+	i = file_des->root_index;
+
+	pthread_rwlock_rdlock(&file_locks[i]);
+	size = rootdirectory[i].file_size;
+	pthread_rwlock_unlock(&file_locks[i]);
+	unlock_fd(file_des);
+
+	return size;
+}
+
+static int do_lseek(int fd, size_t offset)
+{
+	struct file_descriptor *file_des;
+	int i, ret = EXIT_NOERR;
+
+	stat_add(&stats.lseek_calls, 1);
+
+	if (fd < 0) {
+		return EXIT_ERR;
+	}
+
+	file_des = lock_fd(fd);
+
+	if (file_des == NULL) {
+		return EXIT_ERR;
+	}
+	i = file_des->root_index;
+
+	/* staged writes only cover the block around the offset, and flushing
+	 * them is a write to the file */
+	pthread_rwlock_rdlock(&file_locks[i]);
+	if (file_des->stage_end && offset / BLOCK_SIZE != file_des->stage_block) {
+		pthread_rwlock_unlock(&file_locks[i]);
+		pthread_rwlock_wrlock(&file_locks[i]);
+	}
+
+	if (offset > rootdirectory[i].file_size) {
+		ret = EXIT_ERR;
+	} else if (file_des->stage_end &&
+			offset / BLOCK_SIZE != file_des->stage_block &&
+			flush_stage(file_des)) {
+		ret = EXIT_ERR;
+	}
+	pthread_rwlock_unlock(&file_locks[i]);
+
+	if (ret == EXIT_NOERR) {
+		/* a seek elsewhere than where reading left off ends the
+		 * stream */
+		if (offset / BLOCK_SIZE != file_des->ra_next) {
+			file_des->ra_window = 0;
+		}
+		file_des->offset = offset;
+	}
+	unlock_fd(file_des);
+
+	return ret;
+}
+
+/* allocates new data block and links it at end of file's data block chain */
+bool new_block(uint16_t i)
+{	
+	int j;
+
+	pthread_mutex_lock(&alloc_lock);
+
+	/* free blocks are promised to delayed writes */
+	j = free_count == reserved_count ? -1 : find_free_block();
+	if (j < 0) {
+		pthread_mutex_unlock(&alloc_lock);
+		return false;
+	}
+
+	take_block(j);
+	if (chains[i].last_block != FAT_EOC) {
+		set_fat(chains[i].last_block, j);
+	}
+	pthread_mutex_unlock(&alloc_lock);
+
+	if (chains[i].last_block == FAT_EOC) {
+		pthread_mutex_lock(&root_lock);
+		rootdirectory[i].data_index = j;
+		mark_root(i);
+		pthread_mutex_unlock(&root_lock);
+	}
+	stat_add(&stats.blocks_allocated, 1);
+	extend_extents(i, j, 1);
+	chains[i].last_block = j;
+	chains[i].length++;
+
+	return true;
+}
+
+/* returns the number of data blocks in file's data block chain */
+static size_t chain_length(int i)
+{
+	return chains[i].length;
+}
+
+/* remembers data block @index as the @n-th block of descriptor's file */
+static void set_cursor(struct file_descriptor *file_des, size_t n,
+		uint32_t index)
+{
+	file_des->cur_block = n;
+	file_des->cur_index = index;
+	file_des->cur_gen = chain_gens[file_des->root_index];
+}
+
+/* tells whether the descriptor's cursor is set, in its file's current chain */
+static bool has_cursor(struct file_descriptor *file_des)
+{
+	return file_des->cur_index != FAT_EOC &&
+		file_des->cur_gen == chain_gens[file_des->root_index];
+}
+
+/* returns how many of the (at most @max) data blocks of the chain starting at
+ * @index are physically contiguous */
+static size_t chain_run(uint32_t index, size_t max)
+{
+	size_t run = 1;
+
+	if (max > RUN_MAX_BLOCKS) {
+		max = RUN_MAX_BLOCKS;
+	}
+
+	while (run < max && fatblock.block_table[index] == index + 1) {
+		index++;
+		run++;
+	}
+
+	return run;
+}
+
+/* builds the extent map of file @i's chain, or returns NULL if it cannot be
+ * allocated */
+static struct extent_map *build_extents(int i)
+{
+	struct extent_map *map;
+	uint32_t index = rootdirectory[i].data_index;
+	size_t n, run, length = chain_length(i);
+
+	map = malloc(sizeof(*map) + 16 * sizeof(*map->extents));
+	if (map == NULL) {
+		return NULL;
+	}
+	map->count = 0;
+	map->capacity = 16;
+
+	for (n = 0; n < length && index != FAT_EOC; n += run) {
+		run = chain_run(index, length - n);
+		map = add_extent(map, n, index, run);
+		if (map == NULL) {
+			return NULL;
+		}
+		index = fatblock.block_table[index + run - 1];
+	}
+	stat_add(&stats.fat_steps, n);
+
+	return map;
+}
+
+/* returns file @i's extent map, building it if needed, or NULL if it cannot
+ * be built (under the file's lock, shared or not) */
+static struct extent_map *get_extents(int i)
+{
+	struct extent_map *map, *published = NULL;
+
+	map = __atomic_load_n(&extent_maps[i], __ATOMIC_ACQUIRE);
+	if (map != NULL) {
+		return map;
+	}
+
+	/* another reader may publish its map first */
+	map = build_extents(i);
+	if (map != NULL && !__atomic_compare_exchange_n(&extent_maps[i],
+				&published, map, false, __ATOMIC_ACQ_REL,
+				__ATOMIC_ACQUIRE)) {
+		free(map);
+		map = published;
+	}
+
+	return map;
+}
+
+/* returns the data block of logical block @n in an extent map, or FAT_EOC if
+ * the chain is shorter */
+static uint32_t lookup_extent(const struct extent_map *map, size_t n)
+{
+	size_t low = 0, high = map->count, mid;
+	const struct extent *e;
+
+	/* last extent starting at or before @n */
+	while (high - low > 1) {
+		mid = low + (high - low) / 2;
+		if (map->extents[mid].logical <= n) {
+			low = mid;
+		} else {
+			high = mid;
+		}
+	}
+
+	if (map->count == 0) {
+		return FAT_EOC;
+	}
+
+	e = &map->extents[low];
+	if (n < e->logical || n >= e->logical + e->length) {
+		return FAT_EOC;
+	}
+
+	return e->block + (n - e->logical);
+}
+
+/* returns the index of the @n-th data block of file's data block chain,
+ * walking from the descriptor's cursor when it is just before that block, or
+ * looking it up in the file's extent map otherwise */
+static uint32_t find_block(struct file_descriptor *file_des, size_t n)
+{
+	struct extent_map *map;
+	uint32_t index;
+	size_t block, start;
+	bool cursor = has_cursor(file_des) && file_des->cur_block <= n;
+
+	if (cursor && n - file_des->cur_block <= CURSOR_MAX_STEPS) {
+		index = file_des->cur_index;
+		block = file_des->cur_block;
+	} else if (n > CURSOR_MAX_STEPS &&
+			(map = get_extents(file_des->root_index)) != NULL) {
+		index = lookup_extent(map, n);
+		block = n;
+	} else if (cursor) {
+		index = file_des->cur_index;
+		block = file_des->cur_block;
+	} else {
+		index = rootdirectory[file_des->root_index].data_index;
+		block = 0;
+	}
+	start = block;
+
+	while (block < n && index != FAT_EOC) {
+		index = fatblock.block_table[index];
+		block++;
+	}
+	stat_add(&stats.fat_steps, block - start);
+
+	if (index != FAT_EOC) {
+		set_cursor(file_des, n, index);
+		trace_block(index + superblock.data_index);
+	}
+
+	return index;
+}
+
+/* grows the readahead window of a descriptor that read from block @first up
+ * to its cursor sequentially, or resets it, and prefetches the blocks of the
+ * window that follow the cursor */
+static void readahead(struct file_descriptor *file_des, size_t first,
+		size_t next)
+{
+	size_t n, end, run, start, allocated;
+	uint32_t index;
+
+	if (first != file_des->ra_next) {
+		file_des->ra_window = 0;
+		file_des->ra_end = 0;
+	} else if (file_des->ra_window == 0) {
+		file_des->ra_window = RA_MIN_BLOCKS;
+	} else if (file_des->ra_window < RA_MAX_BLOCKS) {
+		file_des->ra_window *= 2;
+	}
+	file_des->ra_next = next;
+
+	if (file_des->ra_window == 0 || !has_cursor(file_des)) {
+		return;
+	}
+
+	/* only prefetch allocated blocks that were not prefetched already */
+	allocated = chain_length(file_des->root_index);
+	end = file_des->cur_block + 1 + file_des->ra_window;
+	if (end > allocated) {
+		end = allocated;
+	}
+	n = file_des->cur_block + 1;
+	if (n < file_des->ra_end) {
+		n = file_des->ra_end;
+	}
+	if (n >= end) {
+		return;
+	}
+
+	/* follow the chain from the cursor, which stays where it is */
+	index = file_des->cur_index;
+	for (run = file_des->cur_block; run < n && index != FAT_EOC; run++) {
+		index = fatblock.block_table[index];
+	}
+
+	/* prefetch the window one physical run at a time */
+	while (n < end && index != FAT_EOC) {
+		start = index;
+		run = 1;
+		while (n + run < end && fatblock.block_table[index] == index + 1) {
+			index++;
+			run++;
+		}
+		if (cache_prefetch(start + superblock.data_index, run)) {
+			break;
+		}
+		n += run;
+		index = fatblock.block_table[index];
+	}
+	file_des->ra_end = n;
+}
+
+/* stages a write of @count bytes at @offset, which fit in one allocated block,
+ * in the descriptor's staging buffer */
+static int stage_write(struct file_descriptor *file_des, size_t offset,
+		const void *buf, size_t count)
+{
+	size_t n = offset / BLOCK_SIZE;
+	size_t start = offset % BLOCK_SIZE, end = start + count;
+
+	/* staged bytes must stay a single range of a single block */
+	if (file_des->stage_end && (file_des->stage_block != n ||
+				end < file_des->stage_start ||
+				start > file_des->stage_end)) {
+		if (flush_stage(file_des)) {
+			return EXIT_ERR;
+		}
+	}
+
+	/* writes of other descriptors come first */
+	if (flush_file_stages(file_des->root_index, file_des)) {
+		return EXIT_ERR;
+	}
+
+	if (file_des->stage == NULL) {
+		file_des->stage = malloc(BLOCK_SIZE);
+		if (file_des->stage == NULL) {
+			return EXIT_ERR;
+		}
+	}
+
+	if (file_des->stage_end == 0) {
+		file_des->stage_block = n;
+		file_des->stage_index = find_block(file_des, n);
+		file_des->stage_start = start;
+		file_des->stage_end = end;
+		file_des->stage_next = stage_list[file_des->root_index];
+		stage_list[file_des->root_index] = file_des;
+	} else {
+		if (start < file_des->stage_start) {
+			file_des->stage_start = start;
+		}
+		if (end > file_des->stage_end) {
+			file_des->stage_end = end;
+		}
+	}
+	memcpy(file_des->stage + start, buf, count);
+
+	/* a full block is written right away (on failure, fs_close() tries
+	 * again) */
+	if (file_des->stage_start == 0 && file_des->stage_end == BLOCK_SIZE) {
+		flush_stage(file_des);
+	}
+
+	return EXIT_NOERR;
+}
+
+/* writes to the file of a descriptor, both being locked */
+static int write_file(struct file_descriptor *file_des, void *buf,
+		size_t count)
+{
+	int root_index;
+	uint32_t offset, file_size;
+	size_t nblocks, allocated, run, tmp_offset, len, old_length;
+	size_t block_start, live, submitted = SIZE_MAX;
+	size_t bytes_written = 0;
+	uint32_t block_index;
+	char bounce_buffer[BLOCK_SIZE];
+
+	root_index = file_des->root_index;
+	offset = file_des->offset;
+	file_size = rootdirectory[root_index].file_size;
+
+	if (offset > file_size) {
+		return EXIT_ERR;
+	}
+
+	if (count == 0) {
+		return 0;
+	}
+
+	/* allocate delayed blocks first if there would be too many of them */
+	if (pending[root_index].nblocks > 0 && offset + count >
+			(chain_length(root_index) + DELAY_MAX_BLOCKS) * BLOCK_SIZE) {
+		if (flush_pending(root_index)) {
+			return EXIT_ERR;
+		}
+	}
+
+	/* extend file to cover the whole write, as far as space allows; with
+	 * delayed allocation, new blocks are only buffered in memory */
+	allocated = chain_length(root_index);
+	old_length = allocated;
+	nblocks = allocated + pending[root_index].nblocks;
+	while (nblocks * BLOCK_SIZE < offset + count &&
+			(delay_alloc ? reserve_block(root_index) :
+			 new_block(root_index))) {
+		nblocks++;
+	}
+	if (!delay_alloc) {
+		allocated = nblocks;
+	}
+	if (nblocks * BLOCK_SIZE < offset + count) {
+		count = nblocks * BLOCK_SIZE - offset;
+	}
+
+	/* disk is full */
+	if (count == 0) {
+		return 0;
+	}
+
+	if (count < BLOCK_SIZE && offset / BLOCK_SIZE < allocated &&
+			offset % BLOCK_SIZE + count <= BLOCK_SIZE &&
+			!stage_write(file_des, offset, buf, count)) {
+		/* small write within a block: staged in the descriptor */
+		bytes_written = count;
+		offset += count;
+		count = 0;
+	} else if (flush_file_stages(root_index, NULL)) {
+		return EXIT_ERR;
+	} else {
+		block_index = find_block(file_des, offset / BLOCK_SIZE);
+	}
+
+	while (count > 0) {
+		tmp_offset = offset % BLOCK_SIZE;
+
+		if (offset / BLOCK_SIZE >= allocated) {
+			/* delayed blocks are only updated in memory */
+			memcpy(pending[root_index].data + offset -
+					allocated * BLOCK_SIZE,
+					(char *)buf + bytes_written, count);
+			len = count;
+		} else if (tmp_offset == 0 && count >= BLOCK_SIZE) {
+			/* whole blocks go straight from user supplied buffer,
+			 * all runs in flight together */
+			run = chain_run(block_index, count / BLOCK_SIZE);
+			if (aio_on ? cache_submit_write_range(block_index +
+						superblock.data_index, run,
+						(char *)buf + bytes_written) :
+					cache_write_range(block_index +
+						superblock.data_index, run,
+						(char *)buf + bytes_written)) {
+				break;
+			}
+			if (submitted == SIZE_MAX) {
+				submitted = bytes_written;
+			}
+			len = run * BLOCK_SIZE;
+			set_cursor(file_des, offset / BLOCK_SIZE + run - 1,
+					block_index + run - 1);
+			block_index = fatblock.block_table[block_index + run - 1];
+		} else {
+			len = BLOCK_SIZE - tmp_offset;
+			if (len > count) {
+				len = count;
+			}
+
+			/* only read the block back if the write leaves some of its
+			 * live data untouched */
+			block_start = offset - tmp_offset;
+			live = block_start < file_size ? file_size - block_start : 0;
+			if (live > 0 && (tmp_offset > 0 || len < live)) {
+				if (cache_read(block_index + superblock.data_index,
+							bounce_buffer)) {
+					break;
+				}
+			} else {
+				memset(bounce_buffer, 0, BLOCK_SIZE);
+			}
+
+			memcpy(bounce_buffer + tmp_offset,
+					(char *)buf + bytes_written, len);
+			if (cache_write(block_index + superblock.data_index,
+						bounce_buffer)) {
+				break;
+			}
+			set_cursor(file_des, offset / BLOCK_SIZE, block_index);
+			block_index = fatblock.block_table[block_index];
+		}
+
+		bytes_written += len;
+		offset += len;
+		count -= len;
+	}
+
+	/* if a submitted run failed, only count what came before the runs */
+	if (submitted != SIZE_MAX && aio_on && cache_wait()) {
+		offset -= bytes_written - submitted;
+		bytes_written = submitted;
+	}
+
+	if (offset > file_size) {
+		pthread_mutex_lock(&root_lock);
+		rootdirectory[root_index].file_size = offset;
+		mark_root(root_index);
+		pthread_mutex_unlock(&root_lock);
+	}
+
+	/* too many delayed blocks: allocate them now (on failure, fs_close() and
+	 * fs_umount() try again) */
+	if (pending[root_index].nblocks > DELAY_MAX_BLOCKS) {
+		flush_pending(root_index);
+	}
+	file_des->offset = offset;
+
+	/* a failed commit is reported by fs_sync() */
+	if (offset > file_size || chain_length(root_index) != old_length) {
+		journal_op();
+	}
+
+	return bytes_written;
+}
+
+static int do_write(int fd, void *buf, size_t count)
+{
+	struct file_descriptor *file_des;
+	int i, ret;
+
+	/* invalid */
+	if (fd < 0) {
+		return EXIT_ERR;
+	}
+
+	file_des = lock_fd(fd);
+
+	/* file fd not currently open */
+	if (file_des == NULL) {
+		return EXIT_ERR;
+	}
+	i = file_des->root_index;
+
+	pthread_rwlock_wrlock(&file_locks[i]);
+	ret = write_file(file_des, buf, count);
+	pthread_rwlock_unlock(&file_locks[i]);
+	unlock_fd(file_des);
+
+	return ret;
+}
+
+/* returns the number of runs of physically contiguous blocks in file @i's
+ * chain */
+static size_t count_extents(int i)
+{
+	uint32_t index = rootdirectory[i].data_index, prev = FAT_EOC;
+	size_t n, runs = 0, length = chain_length(i);
+
+	for (n = 0; n < length && index != FAT_EOC; n++) {
+		if (n == 0 || index != prev + 1) {
+			runs++;
+		}
+		prev = index;
+		index = fatblock.block_table[index];
+	}
+
+	return runs;
+}
+
+/* copies file @i's blocks to a free run of data blocks, if there is one large
+ * enough, and switches the file to it (under the file's write lock); sets
+ * @moved if the file moved */
+static int move_chain(int i, bool *moved)
+{
+	size_t length = chain_length(i), start, run, n, j;
+	uint32_t index, next;
+	char *buf;
+
+	*moved = false;
+
+	/* take the run out of the free space while it gets written */
+	pthread_mutex_lock(&alloc_lock);
+	if (free_count - reserved_count < length ||
+			find_free_run(length, &start) < length) {
+		pthread_mutex_unlock(&alloc_lock);
+		return EXIT_NOERR;
+	}
+	for (j = start; j < start + length; j++) {
+		take_block(j);
+	}
+	pthread_mutex_unlock(&alloc_lock);
+
+	/* copy the data one physical run at a time, through the cache so that
+	 * dirty cached blocks are picked up */
+	buf = malloc(RUN_MAX_BLOCKS * BLOCK_SIZE);
+	index = rootdirectory[i].data_index;
+	for (n = 0; buf != NULL && n < length; n += run) {
+		run = chain_run(index, length - n);
+		if (cache_read_range(index + superblock.data_index, run, buf) ||
+				cache_write_range(start + n +
+					superblock.data_index, run, buf)) {
+			break;
+		}
+		index = fatblock.block_table[index + run - 1];
+	}
+	free(buf);
+
+	if (buf == NULL || n < length) {
+		pthread_mutex_lock(&alloc_lock);
+		for (j = start; j < start + length; j++) {
+			release_block(j);
+		}
+		pthread_mutex_unlock(&alloc_lock);
+		return EXIT_ERR;
+	}
+
+	/* switch the file to the new run, then free the old chain */
+	pthread_mutex_lock(&root_lock);
+	pthread_mutex_lock(&alloc_lock);
+	for (j = start; j + 1 < start + length; j++) {
+		set_fat(j, j + 1);
+	}
+	index = rootdirectory[i].data_index;
+	for (n = 0; n < length; n++) {
+		next = fatblock.block_table[index];
+		release_block(index);
+		index = next;
+	}
+	rootdirectory[i].data_index = start;
+	mark_root(i);
+	pthread_mutex_unlock(&alloc_lock);
+	pthread_mutex_unlock(&root_lock);
+
+	chains[i].last_block = start + length - 1;
+	drop_extents(i);
+	chain_gens[i]++;
+	*moved = true;
+	journal_op();
+
+	return EXIT_NOERR;
+}
+
+static int do_defrag(size_t max_blocks)
+{
+	size_t length, before, moved = 0;
+	int i, n, ret = EXIT_NOERR, first;
+	bool exists, done;
+
+	if (!file_system_open) {
+		printf("file\n");
+		return EXIT_ERR;
+	}
+
+	/* carry on from where the previous call ran out of budget */
+	first = __atomic_load_n(&defrag_next, __ATOMIC_RELAXED);
+	for (n = 0; n < FS_FILE_MAX_COUNT && ret == EXIT_NOERR; n++) {
+		i = (first + n) % FS_FILE_MAX_COUNT;
+
+		/* deleting the file waits until it is moved */
+		pthread_mutex_lock(&root_lock);
+		exists = rootdirectory[i].filename[0] != '\0';
+		if (exists) {
+			move_count[i] += 1;
+		}
+		pthread_mutex_unlock(&root_lock);
+		if (!exists) {
+			continue;
+		}
+
+		pthread_rwlock_wrlock(&file_locks[i]);
+		length = chain_length(i);
+		before = count_extents(i);
+		if (before > 1 && max_blocks && moved + length > max_blocks &&
+				length <= max_blocks) {
+			/* out of budget: the next call starts with this file */
+			pthread_mutex_lock(&root_lock);
+			move_count[i] -= 1;
+			pthread_mutex_unlock(&root_lock);
+			pthread_rwlock_unlock(&file_locks[i]);
+			break;
+		}
+
+		/* files larger than the budget are never moved */
+		if (before > 1 && (!max_blocks || length <= max_blocks)) {
+			/* staged writes hold the old location of their block */
+			if (flush_file_stages(i, NULL) || move_chain(i, &done)) {
+				printf("move %s\n", rootdirectory[i].filename);
+				ret = EXIT_ERR;
+			} else if (done) {
+				moved += length;
+			}
+			printf("file: %s, extents: %zu -> %zu\n",
+					rootdirectory[i].filename, before,
+					count_extents(i));
+		}
+
+		pthread_mutex_lock(&root_lock);
+		move_count[i] -= 1;
+		pthread_mutex_unlock(&root_lock);
+		pthread_rwlock_unlock(&file_locks[i]);
+	}
+	__atomic_store_n(&defrag_next, (first + n) % FS_FILE_MAX_COUNT,
+			__ATOMIC_RELAXED);
+
+	return ret ? EXIT_ERR : (int)moved;
+}
+
+/* reads the runs of a part of a spread read */
+static int fanout_part(void *arg, size_t part)
+{
+	struct fanout *fanout = arg;
+	struct fanout_run *run;
+	size_t r;
+	bool failed = false;
+
+	for (r = fanout->part_start[part]; r < fanout->part_start[part + 1];
+			r++) {
+		run = &fanout->runs[r];
+		if (aio_on ? cache_submit_read_range(run->block, run->count,
+					run->buf) :
+				cache_read_range(run->block, run->count,
+					run->buf)) {
+			failed = true;
+			break;
+		}
+	}
+
+	/* wait for the submitted runs even on failure, as they fill the user
+	 * buffer */
+	if ((aio_on && cache_wait()) || failed) {
+		return EXIT_ERR;
+	}
+
+	return EXIT_NOERR;
+}
+
+/* splits @count whole data blocks, from data block @index, into @parts parts
+ * of equal size made of physical runs, which go to @buf; returns the last data
+ * block, or FAT_EOC if the chain is too short */
+static uint32_t split_fanout(struct fanout *fanout, uint32_t index,
+		size_t count, size_t parts, char *buf)
+{
+	size_t part, end, run, block = 0, runs = 0;
+	uint32_t last = FAT_EOC;
+
+	for (part = 0; part < parts; part++) {
+		fanout->part_start[part] = runs;
+		end = (part + 1) * count / parts;
+		while (block < end) {
+			if (index == FAT_EOC) {
+				return FAT_EOC;
+			}
+			run = chain_run(index, end - block);
+			fanout->runs[runs].block = index + superblock.data_index;
+			fanout->runs[runs].count = run;
+			fanout->runs[runs].buf = buf + block * BLOCK_SIZE;
+			runs++;
+			block += run;
+			last = index + run - 1;
+			index = fatblock.block_table[last];
+		}
+	}
+	fanout->part_start[parts] = runs;
+
+	return last;
+}
+
+/* reads @count whole data blocks of descriptor's file, from its @n-th block
+ * at data block @index, into @buf: the chain is followed once, and the blocks
+ * split in parts read in parallel by the worker pool */
+static int fanout_read(struct file_descriptor *file_des, size_t n,
+		uint32_t index, size_t count, char *buf)
+{
+	struct fanout fanout;
+	size_t parts;
+	uint32_t last = FAT_EOC;
+	int ret = EXIT_ERR;
+
+	parts = count / FANOUT_PART_BLOCKS;
+	if (parts > fanout_threads) {
+		parts = fanout_threads;
+	}
+
+	/* runs are at least one block long */
+	fanout.runs = malloc(count * sizeof(*fanout.runs));
+	fanout.part_start = malloc((parts + 1) * sizeof(*fanout.part_start));
+	if (fanout.runs != NULL && fanout.part_start != NULL) {
+		last = split_fanout(&fanout, index, count, parts, buf);
+	}
+
+	if (last != FAT_EOC) {
+		ret = pool_run(fanout_part, &fanout, parts);
+	}
+	if (ret == EXIT_NOERR) {
+		set_cursor(file_des, n + count - 1, last);
+		stat_add(&stats.fanout_reads, 1);
+	}
+
+	free(fanout.runs);
+	free(fanout.part_start);
+	return ret;
+}
+
+/* reads from the file of a descriptor, both being locked */
+static int read_file(struct file_descriptor *file_des, void *buf,
+		size_t count)
+{
+	int root_index;
+	uint32_t block_index;
+	size_t allocated, run, tmp_offset, len, first;
+	size_t bytes_read = 0;
+	uint32_t offset, file_size;
+	bool submitted = false, failed = false;
+
+	root_index = file_des->root_index;
+	offset = file_des->offset;
+	file_size = rootdirectory[root_index].file_size;
+
+	/* staged writes to the file must be visible */
+	if (flush_file_stages(root_index, NULL)) {
+		return EXIT_ERR;
+	}
+
+	/* nothing left to read */
+	if (offset >= file_size || count == 0) {
+		return 0;
+	}
+	if (count > file_size - offset) {
+		count = file_size - offset;
+	}
+
+	allocated = chain_length(root_index);
+	first = offset / BLOCK_SIZE;
+	block_index = find_block(file_des, first);
+
+	while (count > 0) {
+		tmp_offset = offset % BLOCK_SIZE;
+
+		if (offset / BLOCK_SIZE >= allocated) {
+			/* delayed blocks are only in memory */
+			memcpy((char *)buf + bytes_read, pending[root_index].data +
+					offset - allocated * BLOCK_SIZE, count);
+			len = count;
+		} else if (block_index == FAT_EOC) {
+			break;
+		} else if (fanout_threads > 1 && tmp_offset == 0 &&
+				count / BLOCK_SIZE >= FANOUT_MIN_BLOCKS &&
+				allocated - offset / BLOCK_SIZE >=
+				FANOUT_MIN_BLOCKS) {
+			/* many whole blocks: spread over the worker pool */
+			run = count / BLOCK_SIZE;
+			if (run > allocated - offset / BLOCK_SIZE) {
+				run = allocated - offset / BLOCK_SIZE;
+			}
+			if (fanout_read(file_des, offset / BLOCK_SIZE,
+						block_index, run,
+						(char *)buf + bytes_read)) {
+				failed = true;
+				break;
+			}
+			len = run * BLOCK_SIZE;
+			block_index = fatblock.block_table[file_des->cur_index];
+		} else if (tmp_offset == 0 && count >= BLOCK_SIZE) {
+			/* whole blocks go straight into user supplied buffer,
+			 * all runs in flight together */
+			run = chain_run(block_index, count / BLOCK_SIZE);
+			if (aio_on ? cache_submit_read_range(block_index +
+						superblock.data_index, run,
+						(char *)buf + bytes_read) :
+					cache_read_range(block_index +
+						superblock.data_index, run,
+						(char *)buf + bytes_read)) {
+				failed = true;
+				break;
+			}
+			submitted = true;
+			len = run * BLOCK_SIZE;
+			set_cursor(file_des, offset / BLOCK_SIZE + run - 1,
+					block_index + run - 1);
+			block_index = fatblock.block_table[block_index + run - 1];
+		} else {
+			/* partial block: copied straight from the cached or
+			 * mapped block */
+			len = BLOCK_SIZE - tmp_offset;
+			if (len > count) {
+				len = count;
+			}
+			if (cache_read_part(block_index + superblock.data_index,
+						tmp_offset, len,
+						(char *)buf + bytes_read)) {
+				failed = true;
+				break;
+			}
+			set_cursor(file_des, offset / BLOCK_SIZE, block_index);
+			block_index = fatblock.block_table[block_index];
+		}
+
+		bytes_read += len;
+		offset += len;
+		count -= len;
+	}
+
+	/* wait for the submitted runs even on failure, as they fill @buf */
+	if ((submitted && aio_on && cache_wait()) || failed) {
+		return EXIT_ERR;
+	}
+
+	file_des->offset = offset;
+	readahead(file_des, first, offset / BLOCK_SIZE);
+	
+	return bytes_read;
+}
+
+static int do_read(int fd, void *buf, size_t count)
+{
+	struct file_descriptor *file_des;
+	int i, ret;
+
+	if (fd < 0) {
+		return EXIT_ERR;
+	}
+
+	file_des = lock_fd(fd);
+
+	/* file fd not currently open */
+	if (file_des == NULL) {
+		return EXIT_ERR;
+	}
+	i = file_des->root_index;
+
+	/* readers share the file, unless staged writes must be flushed first */
+	pthread_rwlock_rdlock(&file_locks[i]);
+	if (stage_list[i] != NULL) {
+		pthread_rwlock_unlock(&file_locks[i]);
+		pthread_rwlock_wrlock(&file_locks[i]);
+	}
+	ret = read_file(file_des, buf, count);
+	pthread_rwlock_unlock(&file_locks[i]);
+	unlock_fd(file_des);
+
+	return ret;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* counts a call that took @ns nanoseconds in latency histogram @hist */
+static void record_latency(unsigned long long *hist, uint64_t ns)
+{
+	int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+
+	if (bucket >= FS_LAT_BUCKETS) {
+		bucket = FS_LAT_BUCKETS - 1;
+	}
+	stat_add(&hist[bucket], 1);
+}
+
+/* fills in the arguments of file operation @ev on descriptor @fd, which
+ * covers @length bytes from @offset */
+static void trace_args(struct trace_event *ev, int fd, size_t offset,
+		size_t length)
+{
+	ev->fd = fd;
+	ev->offset = offset;
+	ev->length = length;
+	ev->count = length ? (offset + length - 1) / BLOCK_SIZE -
+		offset / BLOCK_SIZE + 1 : 0;
+}
+
+/* returns the offset of descriptor @fd, or 0 if it is not open */
+static size_t fd_offset(int fd)
+{
+	struct file_descriptor *file_des = lock_fd(fd);
+	size_t offset = 0;
+
+	if (file_des != NULL) {
+		offset = file_des->offset;
+		unlock_fd(file_des);
+	}
+
+	return offset;
+}
+
+/* starts an operation that runs alongside the other file operations, unless
+ * no file system is mounted */
+static int begin_op(void)
+{
+	pthread_rwlock_rdlock(&mount_lock);
+	if (!file_system_open) {
+		pthread_rwlock_unlock(&mount_lock);
+		return EXIT_ERR;
+	}
+
+	return EXIT_NOERR;
+}
+
+/* ends an operation started with begin_op(), and commits the journal if the
+ * operation completed a group; returns @ret, or an error if @report and the
+ * commit fails */
+static int end_op(int ret, bool report)
+{
+	pthread_rwlock_unlock(&mount_lock);
+
+	/* the commit writes the metadata of every file */
+	if (__atomic_load_n(&commit_due, __ATOMIC_ACQUIRE)) {
+		pthread_rwlock_wrlock(&mount_lock);
+		if (commit_due && commit_journal() && report) {
+			ret = EXIT_ERR;
+		}
+		pthread_rwlock_unlock(&mount_lock);
+	}
+
+	return ret;
+}
+
+int fs_format(const char *diskname, int format)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&mount_lock);
+	ret = do_format(diskname, format);
+	pthread_rwlock_unlock(&mount_lock);
+
+	return ret;
+}
+
+int fs_mount_opts(const char *diskname, const struct fs_options *opts)
+{
+	struct trace_event *ev = trace_begin(TRACE_FS_MOUNT);
+	int ret;
+
+	pthread_rwlock_wrlock(&mount_lock);
+	ret = do_mount(diskname, opts);
+	pthread_rwlock_unlock(&mount_lock);
+	trace_end(ev, ret);
+
+	return ret;
+}
+
+int fs_umount(void)
+{
+	struct trace_event *ev = trace_begin(TRACE_FS_UMOUNT);
+	int ret;
+
+	pthread_rwlock_wrlock(&mount_lock);
+	ret = do_umount();
+	pthread_rwlock_unlock(&mount_lock);
+	trace_end(ev, ret);
+
+	return ret;
+}
+
+int fs_sync(void)
+{
+	struct trace_event *ev = trace_begin(TRACE_FS_SYNC);
+	int ret;
+
+	pthread_rwlock_wrlock(&mount_lock);
+	ret = do_sync();
+	pthread_rwlock_unlock(&mount_lock);
+	trace_end(ev, ret);
+
+	return ret;
+}
+
+int fs_info(void)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&mount_lock);
+	ret = do_info();
+	pthread_rwlock_unlock(&mount_lock);
+
+	return ret;
+}
+
+int fs_check(int repair)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&mount_lock);
+	ret = do_check(repair);
+	pthread_rwlock_unlock(&mount_lock);
+
+	return ret;
+}
+
+int fs_defrag(size_t max_blocks)
+{
+	int ret;
+
+	if (begin_op()) {
+		return EXIT_ERR;
+	}
+	ret = do_defrag(max_blocks);
+	ret = end_op(ret, true);
+
+	return ret;
+}
+
+int fs_create(const char *filename)
+{
+	struct trace_event *ev = trace_begin(TRACE_FS_CREATE);
+	int ret;
+
+	if (begin_op()) {
+		trace_end(ev, EXIT_ERR);
+		return EXIT_ERR;
+	}
+	ret = do_create(filename);
+	ret = end_op(ret, true);
+	trace_end(ev, ret);
+
+	return ret;
+}
+
+int fs_delete(const char *filename)
+{
+	struct trace_event *ev = trace_begin(TRACE_FS_DELETE);
+	int ret;
+
+	if (begin_op()) {
+		trace_end(ev, EXIT_ERR);
+		return EXIT_ERR;
+	}
+	ret = do_delete(filename);
+	ret = end_op(ret, true);
+	trace_end(ev, ret);
+
+	return ret;
+}
+
+int fs_ls(void)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&mount_lock);
+	ret = do_ls();
+	pthread_rwlock_unlock(&mount_lock);
+
+	return ret;
+}
+
+int fs_open(const char *filename)
+{
+	struct trace_event *ev = trace_begin(TRACE_FS_OPEN);
+	int ret;
+
+	if (begin_op()) {
+		trace_end(ev, EXIT_ERR);
+		return EXIT_ERR;
+	}
+	ret = do_open(filename);
+	ret = end_op(ret, false);
+	if (ev) {
+		ev->fd = ret;
+	}
+	trace_end(ev, ret);
+
+	return ret;
+}
+
+int fs_close(int fd)
+{
+	struct trace_event *ev = trace_begin(TRACE_FS_CLOSE);
+	int ret;
+
+	if (begin_op()) {
+		trace_end(ev, EXIT_ERR);
+		return EXIT_ERR;
+	}
+	if (ev) {
+		trace_args(ev, fd, fd_offset(fd), 0);
+	}
+	ret = do_close(fd);
+	ret = end_op(ret, true);
+	trace_end(ev, ret);
+
+	return ret;
+}
+
+int fs_flush(int fd)
+{
+	struct trace_event *ev = trace_begin(TRACE_FS_FLUSH);
+	int ret;
+
+	if (begin_op()) {
+		trace_end(ev, EXIT_ERR);
+		return EXIT_ERR;
+	}
+	if (ev) {
+		trace_args(ev, fd, fd_offset(fd), 0);
+	}
+	ret = do_flush(fd);
+	ret = end_op(ret, true);
+	trace_end(ev, ret);
+
+	return ret;
+}
+
+int fs_stat(int fd)
+{
+	struct trace_event *ev = trace_begin(TRACE_FS_STAT);
+	int ret;
+
+	if (begin_op()) {
+		trace_end(ev, EXIT_ERR);
+		return EXIT_ERR;
+	}
+	if (ev) {
+		trace_args(ev, fd, fd_offset(fd), 0);
+	}
+	ret = do_stat(fd);
+	ret = end_op(ret, false);
+	trace_end(ev, ret);
+
+	return ret;
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	struct trace_event *ev = trace_begin(TRACE_FS_LSEEK);
+	int ret;
+
+	if (begin_op()) {
+		trace_end(ev, EXIT_ERR);
+		return EXIT_ERR;
+	}
+	if (ev) {
+		trace_args(ev, fd, offset, 0);
+	}
+	ret = do_lseek(fd, offset);
+	ret = end_op(ret, false);
+	trace_end(ev, ret);
+
+	return ret;
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	struct trace_event *ev = trace_begin(TRACE_FS_WRITE);
+	uint64_t start = now_ns();
+	int ret;
+
+	if (begin_op()) {
+		trace_end(ev, EXIT_ERR);
+		return EXIT_ERR;
+	}
+	if (ev) {
+		trace_args(ev, fd, fd_offset(fd), count);
+	}
+	stat_add(&stats.write_calls, 1);
+	ret = do_write(fd, buf, count);
+	ret = end_op(ret, false);
+	record_latency(stats.write_latency, now_ns() - start);
+	trace_end(ev, ret);
+
+	return ret;
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	struct trace_event *ev = trace_begin(TRACE_FS_READ);
+	uint64_t start = now_ns();
+	int ret;
+
+	if (begin_op()) {
+		trace_end(ev, EXIT_ERR);
+		return EXIT_ERR;
+	}
+	if (ev) {
+		trace_args(ev, fd, fd_offset(fd), count);
+	}
+	stat_add(&stats.read_calls, 1);
+	ret = do_read(fd, buf, count);
+	ret = end_op(ret, false);
+	record_latency(stats.read_latency, now_ns() - start);
+	trace_end(ev, ret);
+
+	return ret;
+}
+
+int fs_get_stats(struct fs_stats *st)
+{
+	unsigned long long *counters = (unsigned long long *)&stats;
+	struct block_stats disk_stats;
+	size_t i;
+
+	if (st == NULL) {
+		return EXIT_ERR;
+	}
+
+	/* every field is a counter updated on its own */
+	block_get_stats(&disk_stats);
+	for (i = 0; i < sizeof(stats) / sizeof(*counters); i++) {
+		((unsigned long long *)st)[i] =
+			__atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+	}
+	st->block_reads = disk_stats.reads;
+	st->block_writes = disk_stats.writes;
+	st->bytes_read = disk_stats.bytes_read;
+	st->bytes_written = disk_stats.bytes_written;
+
+	return EXIT_NOERR;
+}
+
+void fs_reset_stats(void)
+{
+	memset(&stats, 0, sizeof(stats));
+	block_reset_stats();
+}
+
+int fs_trace_start(size_t events)
+{
+	return trace_start(events) ? EXIT_ERR : EXIT_NOERR;
+}
+
+int fs_trace_stop(void)
+{
+	return trace_stop() ? EXIT_ERR : EXIT_NOERR;
+}
+
+int fs_trace_dump(const char *filename)
+{
+	if (filename == NULL) {
+		return EXIT_ERR;
+	}
+
+	return trace_dump(filename) ? EXIT_ERR : EXIT_NOERR;
 }
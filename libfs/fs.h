@@ -9,33 +9,148 @@
 /** Maximum number of files in the root directory */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
+/** Default maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Largest maximum number of open files that can be set at mount */
+#define FS_OPEN_MAX_LIMIT 65536
+
+/** Default number of blocks held by the block cache */
+#define FS_CACHE_BLOCKS 512
+
+/** Default number of disk requests kept in flight by a read or write */
+#define FS_IO_DEPTH 64
+
+/** Default number of threads a large read is spread over */
+#define FS_READ_THREADS 4
+
+/** Default number of operations batched in a journal commit */
+#define FS_JOURNAL_GROUP 32
+
+/** Number of buckets of the latency histograms */
+#define FS_LAT_BUCKETS 32
+
+/** On-disk format with 16-bit block numbers and FAT entries (up to 65534
+ * data blocks) */
+#define FS_FORMAT_FAT16 1
+
+/** On-disk format with a versioned superblock, and 32-bit block numbers and
+ * FAT entries */
+#define FS_FORMAT_FAT32 2
+
+/**
+ * struct fs_options - File system mount options
+ * @cache_blocks: Number of data blocks kept in the block cache (0 disables
+ *                caching)
+ * @map_disk: Map the whole disk image in memory, so that reads are served
+ *            straight from the mapping (the block cache can then be disabled)
+ * @delay_alloc: Delay the allocation of the blocks appended to a file until it
+ *               is flushed or closed, so that they can be allocated together
+ *               as a contiguous run
+ * @open_max: Maximum number of files open simultaneously, up to
+ *            %FS_OPEN_MAX_LIMIT (0 selects %FS_OPEN_MAX_COUNT)
+ * @journal_blocks: Size of the metadata journal to create if the disk does not
+ *                  have one yet (0 leaves the disk without journal)
+ * @journal_group: Number of operations batched in a single journal commit (0
+ *                 selects %FS_JOURNAL_GROUP)
+ * @io_depth: Number of disk requests that a single fs_read() or fs_write() can
+ *            keep in flight, through io_uring when the kernel supports it (0 or
+ *            1 waits for each request in turn)
+ * @read_threads: Number of threads, including the calling one, that a single
+ *                fs_read() of several megabytes is spread over (0 or 1 reads on
+ *                the calling thread only)
+ *
+ * With a metadata journal, the changes to the FAT and the root directory made
+ * by fs_create(), fs_delete() and block allocations are recorded in a journal
+ * region of the disk, a group of operations at a time, and replayed when the
+ * disk is mounted again after a crash. A journal, once created, is used by
+ * every later mount.
+ */
+struct fs_options {
+	size_t cache_blocks;
+	int map_disk;
+	int delay_alloc;
+	size_t open_max;
+	size_t journal_blocks;
+	unsigned int journal_group;
+	unsigned int io_depth;
+	unsigned int read_threads;
+};
+
+/**
+ * fs_format - Create an empty file system
+ * @diskname: Name of the virtual disk file
+ * @format: On-disk format, %FS_FORMAT_FAT16 or %FS_FORMAT_FAT32
+ *
+ * Lay out an empty file system of format @format over the whole virtual disk
+ * file @diskname, whose size must already be a multiple of the block size:
+ * superblock, as many FAT blocks as needed, root directory, and data blocks.
+ * No file system can be mounted meanwhile.
+ *
+ * Return: -1 if a file system is mounted, if @format is invalid, if virtual
+ * disk file @diskname cannot be opened, if it is too small, or too large for
+ * @format, or if it cannot be written. 0 otherwise.
+ */
+int fs_format(const char *diskname, int format);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
  *
  * Open the virtual disk file @diskname and mount the file system that it
  * contains. A file system needs to be mounted before files can be read from it
- * with fs_read() or written to it with fs_write().
+ * with fs_read() or written to it with fs_write(). The signature of the
+ * superblock tells the format of the disk, %FS_FORMAT_FAT16 or
+ * %FS_FORMAT_FAT32, and either works the same once mounted.
+ *
+ * Once mounted, the file system can be used by several threads at once:
+ * operations on different files run in parallel, and so do reads of the same
+ * file, while writes to a file exclude the other operations on that file.
+ * Mounting, unmounting, fs_sync(), fs_info() and fs_ls() wait for the
+ * operations in progress to complete.
  *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
  */
 int fs_mount(const char *diskname);
 
+/**
+ * fs_mount_opts - Mount a file system with options
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options, or NULL for the defaults
+ *
+ * Same as fs_mount(), but with explicit mount options. fs_mount() is equivalent
+ * to fs_mount_opts(@diskname, NULL).
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, if no valid file
+ * system can be located, or if the block cache cannot be allocated. 0
+ * otherwise.
+ */
+int fs_mount_opts(const char *diskname, const struct fs_options *opts);
+
 /**
  * fs_umount - Unmount file system
  *
  * Unmount the currently mounted file system and close the underlying virtual
- * disk file.
+ * disk file. Pending changes are written back first, as with fs_sync().
  *
  * Return: -1 if no underlying virtual disk was opened, or if the virtual disk
  * cannot be closed, or if there are still open file descriptors. 0 otherwise.
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Write back file system changes
+ *
+ * Write all the file data buffered in memory to the disk, followed by the
+ * metadata blocks (FAT and root directory) changed since they were last written
+ * back, or to the journal if the disk has one. Files can stay open.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if some data or
+ * metadata cannot be written. 0 otherwise.
+ */
+int fs_sync(void);
+
 /**
  * fs_info - Display information about file system
  *
@@ -45,6 +160,48 @@ int fs_umount(void);
  */
 int fs_info(void);
 
+/**
+ * fs_check - Check the consistency of the file system
+ * @repair: Repair the problems found
+ *
+ * Check the superblock against the geometry of the disk, then walk the block
+ * chain of every file, in parallel over the threads set by the read_threads
+ * mount option, and the chain of the journal. Report on the standard output
+ * the chains with an invalid block or a cycle, the blocks shared between
+ * chains, the files whose size does not match the length of their chain, and
+ * the blocks in use that no chain reaches.
+ *
+ * With @repair set, a chain is cut before its first invalid, repeated or
+ * shared block (a shared block stays with the journal, or else with the file
+ * listed first), and after the blocks its size needs. A file whose chain got
+ * shorter than its size is shrunk, and unreachable blocks are freed. The
+ * repaired metadata is then written back as with fs_sync(). Repairs require
+ * every file to be closed.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if the superblock does
+ * not allow the FAT to be walked, or if files are open or the repairs cannot
+ * be written with @repair set. Otherwise, the number of problems found.
+ */
+int fs_check(int repair);
+
+/**
+ * fs_defrag - Defragment files
+ * @max_blocks: Largest number of blocks to move, or 0 for no limit
+ *
+ * Move the blocks of each file made of several runs of contiguous blocks into
+ * a single free run, when there is one large enough, and print the number of
+ * runs (extents) of the file before and after. Files can be used meanwhile:
+ * only the operations on the file being moved wait for it. With a limit of
+ * @max_blocks, the files larger than the limit are skipped, and the call stops
+ * at the first file that does not fit in what is left of it; the next call
+ * starts with that file, so that successive calls defragment the whole disk
+ * a bit at a time.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if a file cannot be
+ * moved. Otherwise, the number of blocks moved.
+ */
+int fs_defrag(size_t max_blocks);
+
 /**
  * fs_create - Create a new file
  * @filename: File name
@@ -90,11 +247,14 @@ int fs_ls(void);
  * that is used subsequently to access the contents of the file. The file offset
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * descriptors. A maximum of %FS_OPEN_MAX_COUNT files (or as many as set by the
+ * open_max mount option) can be open simultaneously. A closed file descriptor
+ * is never valid again, even when its slot gets reused by another file: a slot
+ * is retired once its descriptor values are used up, so that opens start to
+ * fail after 2^30 to 2^31 of them in a single mount.
  *
  * Return: -1 if @filename is invalid, there is no file named @filename to open,
- * or if there are already %FS_OPEN_MAX_COUNT files currently open. Otherwise,
+ * or if the maximum number of files are already currently open. Otherwise,
  * return the file descriptor.
  */
 int fs_open(const char *filename);
@@ -103,13 +263,27 @@ int fs_open(const char *filename);
  * fs_close - Close a file
  * @fd: File descriptor
  *
- * Close file descriptor @fd.
+ * Close file descriptor @fd, after flushing the file as fs_flush() does.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). 0 otherwise.
+ * open), or if the file cannot be flushed. 0 otherwise.
  */
 int fs_close(int fd);
 
+/**
+ * fs_flush - Flush a file
+ * @fd: File descriptor
+ *
+ * Write the data buffered in memory for the file referenced by file descriptor
+ * @fd to the disk: the small writes staged in @fd, and with delayed allocation,
+ * the blocks appended to the file, which get allocated then. fs_close()
+ * implicitly flushes the file.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if the data cannot be written. 0 otherwise.
+ */
+int fs_flush(int fd);
+
 /**
  * fs_stat - Get file status
  * @fd: File descriptor
@@ -152,6 +326,11 @@ int fs_lseek(int fd, size_t offset);
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
  *
+ * Small writes that fit in a single block are staged in the file descriptor,
+ * and only written to the block once it is full, when the file offset moves to
+ * another block, or when the file is flushed, read, or written through another
+ * file descriptor.
+ *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
  * open). Otherwise return the number of bytes actually written.
  */
@@ -177,4 +356,97 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * struct fs_stats - File system statistics
+ * @block_reads: Number of disk read requests
+ * @block_writes: Number of disk write requests
+ * @bytes_read: Number of bytes read from the disk
+ * @bytes_written: Number of bytes written to the disk
+ * @fat_steps: Number of FAT entries followed to find the blocks of files
+ * @blocks_allocated: Number of data blocks allocated to files
+ * @create_calls: Number of calls to fs_create()
+ * @delete_calls: Number of calls to fs_delete()
+ * @open_calls: Number of calls to fs_open()
+ * @close_calls: Number of calls to fs_close()
+ * @stat_calls: Number of calls to fs_stat()
+ * @lseek_calls: Number of calls to fs_lseek()
+ * @read_calls: Number of calls to fs_read()
+ * @write_calls: Number of calls to fs_write()
+ * @fanout_reads: Number of fs_read() calls spread across several threads
+ * @read_latency: Histogram of the latency of fs_read() calls
+ * @write_latency: Histogram of the latency of fs_write() calls
+ *
+ * Bucket i of a latency histogram counts the calls that took less than 2^i
+ * nanoseconds, but not less than 2^(i-1). The last bucket also counts the
+ * slower calls.
+ */
+struct fs_stats {
+	unsigned long long block_reads;
+	unsigned long long block_writes;
+	unsigned long long bytes_read;
+	unsigned long long bytes_written;
+	unsigned long long fat_steps;
+	unsigned long long blocks_allocated;
+	unsigned long long create_calls;
+	unsigned long long delete_calls;
+	unsigned long long open_calls;
+	unsigned long long close_calls;
+	unsigned long long stat_calls;
+	unsigned long long lseek_calls;
+	unsigned long long read_calls;
+	unsigned long long write_calls;
+	unsigned long long fanout_reads;
+	unsigned long long read_latency[FS_LAT_BUCKETS];
+	unsigned long long write_latency[FS_LAT_BUCKETS];
+};
+
+/**
+ * fs_get_stats - Get file system statistics
+ * @stats: Statistics to fill
+ *
+ * Get the statistics accumulated since the program started, or since the last
+ * call to fs_reset_stats(), across mounts.
+ *
+ * Return: -1 if @stats is NULL. 0 otherwise.
+ */
+int fs_get_stats(struct fs_stats *stats);
+
+/**
+ * fs_reset_stats - Reset file system statistics
+ */
+void fs_reset_stats(void);
+
+/**
+ * fs_trace_start - Start tracing file system operations
+ * @events: Number of events kept per thread
+ *
+ * Start recording every file system operation (fs_mount_opts() to fs_read())
+ * and every disk request it makes, with its arguments, result and duration.
+ * Each thread keeps its last @events events; older ones get overwritten.
+ * Events of a previous tracing session are discarded. While tracing is
+ * stopped, operations only pay for a single test.
+ *
+ * Return: -1 if @events is 0. 0 otherwise.
+ */
+int fs_trace_start(size_t events);
+
+/**
+ * fs_trace_stop - Stop tracing file system operations
+ *
+ * Return: -1 if tracing was not started. 0 otherwise.
+ */
+int fs_trace_stop(void);
+
+/**
+ * fs_trace_dump - Write recorded operations to a file
+ * @filename: File name
+ *
+ * Write the events recorded by the last tracing session to file @filename, in
+ * the Chrome trace event format that chrome://tracing and Perfetto load. Must
+ * not be called while other threads run file system operations.
+ *
+ * Return: -1 if @filename is invalid or cannot be written. 0 otherwise.
+ */
+int fs_trace_dump(const char *filename);
+
 #endif /* _FS_H */
@@ -0,0 +1,278 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+#include "journal.h"
+
+#define journal_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define JOURNAL_MAGIC 0x4C4E524A /* "JRNL" */
+
+/* Header at the start of every journal block */
+struct __attribute__((__packed__)) journal_header {
+	uint32_t magic;
+	/* FNV-1a hash of the whole block, computed with this field set to 0 */
+	uint32_t checksum;
+	/* Position of the block in the log, ever increasing across resets */
+	uint64_t sequence;
+	/* Number of blocks in the commit, and rank of this block in it */
+	uint16_t commit_blocks;
+	uint16_t commit_index;
+	/* Number of commit bytes held by this block */
+	uint16_t length;
+};
+
+/* Number of commit bytes a journal block can hold */
+#define PAYLOAD_SIZE (BLOCK_SIZE - sizeof(struct journal_header))
+
+/* Journal instance description */
+struct journal {
+	/* Journal is open */
+	bool open;
+	/* Journal region */
+	size_t start;
+	size_t count;
+	/* Next block to write in the region */
+	size_t pos;
+	/* Sequence number of the first block of the region */
+	uint64_t base;
+	/* Sequence number to start from at next reset */
+	uint64_t next_sequence;
+};
+
+static struct journal journal;
+
+static uint32_t block_checksum(const uint8_t *block)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < BLOCK_SIZE; i++) {
+		/* the checksum field itself counts as zeroes */
+		if (i >= offsetof(struct journal_header, checksum) &&
+		    i < offsetof(struct journal_header, sequence))
+			hash = hash * 16777619u;
+		else
+			hash = (hash ^ block[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+/* fills journal block @block with header and payload */
+static void build_block(uint8_t *block, uint64_t sequence, size_t commit_blocks,
+			size_t commit_index, const void *data, size_t len)
+{
+	struct journal_header header = {
+		.magic = JOURNAL_MAGIC,
+		.checksum = 0,
+		.sequence = sequence,
+		.commit_blocks = commit_blocks,
+		.commit_index = commit_index,
+		.length = len,
+	};
+
+	memset(block, 0, BLOCK_SIZE);
+	memcpy(block, &header, sizeof(header));
+	if (len)
+		memcpy(block + sizeof(header), data, len);
+
+	header.checksum = block_checksum(block);
+	memcpy(block, &header, sizeof(header));
+}
+
+static bool valid_block(const uint8_t *block, struct journal_header *header)
+{
+	memcpy(header, block, sizeof(*header));
+
+	return header->magic == JOURNAL_MAGIC &&
+		header->length <= PAYLOAD_SIZE &&
+		header->commit_index < header->commit_blocks &&
+		header->checksum == block_checksum(block);
+}
+
+int journal_open(size_t block, size_t count)
+{
+	if (journal.open) {
+		journal_error("journal already open");
+		return -1;
+	}
+
+	if (count < 2) {
+		journal_error("journal too small (%zu blocks)", count);
+		return -1;
+	}
+
+	memset(&journal, 0, sizeof(journal));
+	journal.start = block;
+	journal.count = count;
+	journal.pos = count;
+	journal.open = true;
+
+	return 0;
+}
+
+int journal_close(void)
+{
+	if (!journal.open) {
+		journal_error("no journal currently open");
+		return -1;
+	}
+
+	journal.open = false;
+
+	return 0;
+}
+
+int journal_replay(int (*apply)(const void *data, size_t len))
+{
+	struct journal_header header, first;
+	uint8_t *region, *data;
+	size_t i, j, k, len;
+	int commits = 0;
+
+	region = malloc(journal.count * BLOCK_SIZE);
+	data = malloc(journal.count * PAYLOAD_SIZE);
+	if (!region || !data) {
+		free(region);
+		free(data);
+		return -1;
+	}
+
+	if (block_read_range(journal.start, journal.count, region)) {
+		free(region);
+		free(data);
+		return -1;
+	}
+
+	/* next reset must outnumber every block ever written */
+	for (i = 0; i < journal.count; i++) {
+		if (valid_block(region + i * BLOCK_SIZE, &header) &&
+		    header.sequence >= journal.next_sequence)
+			journal.next_sequence = header.sequence + 1;
+	}
+
+	/* commits follow each other with consecutive sequence numbers from
+	 * the first block, which is always written by a reset */
+	if (!valid_block(region, &first)) {
+		free(region);
+		free(data);
+		return 0;
+	}
+
+	i = 0;
+	while (i < journal.count) {
+		if (!valid_block(region + i * BLOCK_SIZE, &header) ||
+		    header.sequence != first.sequence + i ||
+		    header.commit_index != 0 ||
+		    i + header.commit_blocks > journal.count)
+			break;
+
+		/* gather the commit, which is only valid as a whole */
+		k = header.commit_blocks;
+		len = 0;
+		for (j = 0; j < k; j++) {
+			if (!valid_block(region + (i + j) * BLOCK_SIZE, &header) ||
+			    header.sequence != first.sequence + i + j ||
+			    header.commit_index != j ||
+			    header.commit_blocks != k)
+				break;
+			memcpy(data + len,
+			       region + (i + j) * BLOCK_SIZE + sizeof(header),
+			       header.length);
+			len += header.length;
+		}
+		if (j < k)
+			break;
+
+		if (len && apply) {
+			if (apply(data, len)) {
+				free(region);
+				free(data);
+				return -1;
+			}
+			commits++;
+		}
+		i += k;
+	}
+
+	free(region);
+	free(data);
+
+	return commits;
+}
+
+int journal_reset(void)
+{
+	uint8_t block[BLOCK_SIZE];
+
+	/* what the commits hold must be in place on disk before they go */
+	if (block_disk_sync())
+		return -1;
+
+	/* an empty commit at the start invalidates everything after it */
+	build_block(block, journal.next_sequence, 1, 0, NULL, 0);
+	if (block_write(journal.start, block))
+		return -1;
+
+	/* and must be on disk before anything the commits held is written over */
+	if (block_disk_sync())
+		return -1;
+
+	journal.base = journal.next_sequence;
+	journal.pos = 1;
+	journal.next_sequence = journal.base + journal.count;
+
+	return 0;
+}
+
+int journal_commit(const void *data, size_t len)
+{
+	size_t i, k = (len + PAYLOAD_SIZE - 1) / PAYLOAD_SIZE, chunk;
+	const uint8_t *src = data;
+	uint8_t *blocks;
+
+	if (k == 0 || len > journal_space())
+		return -1;
+
+	blocks = malloc(k * BLOCK_SIZE);
+	if (!blocks)
+		return -1;
+
+	for (i = 0; i < k; i++) {
+		chunk = len - i * PAYLOAD_SIZE;
+		if (chunk > PAYLOAD_SIZE)
+			chunk = PAYLOAD_SIZE;
+		build_block(blocks + i * BLOCK_SIZE,
+			    journal.base + journal.pos + i, k, i,
+			    src + i * PAYLOAD_SIZE, chunk);
+	}
+
+	/* the blocks the commit refers to must be on disk before it, and the
+	 * commit before anything that relies on it */
+	if (block_disk_sync() ||
+	    block_write_range(journal.start + journal.pos, k, blocks) ||
+	    block_disk_sync()) {
+		free(blocks);
+		return -1;
+	}
+	free(blocks);
+
+	journal.pos += k;
+
+	return 0;
+}
+
+size_t journal_space(void)
+{
+	return (journal.count - journal.pos) * PAYLOAD_SIZE;
+}
+
+size_t journal_capacity(void)
+{
+	return (journal.count - 1) * PAYLOAD_SIZE;
+}
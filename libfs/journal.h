@@ -0,0 +1,82 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stddef.h> /* for size_t definition */
+
+/**
+ * journal_open - Open the journal region of the disk
+ * @block: Index of the first block of the journal region
+ * @count: Number of blocks in the journal region (at least 2)
+ *
+ * Open the journal stored in blocks @block to @block + @count - 1. The journal
+ * is a log of commits, each made of an opaque array of bytes. After opening,
+ * the commits left by the previous mount should be replayed with
+ * journal_replay(), and the journal emptied with journal_reset().
+ *
+ * Return: -1 if the journal is already open or the region is too small. 0
+ * otherwise.
+ */
+int journal_open(size_t block, size_t count);
+
+/**
+ * journal_close - Close the journal
+ *
+ * Return: -1 if the journal was not open. 0 otherwise.
+ */
+int journal_close(void);
+
+/**
+ * journal_replay - Replay the commits of the journal
+ * @apply: Function called with the content of each commit, in order, or NULL
+ *
+ * Read the journal from the start and call @apply with the content of each
+ * complete commit found, until the first torn, corrupted or stale one.
+ * Function @apply returns -1 to stop the replay with an error, 0 otherwise.
+ * journal_replay() must be called once after journal_open(), if only with a
+ * NULL @apply to skip the commits, before the journal can be reset.
+ *
+ * Return: -1 if the journal cannot be read or if @apply fails. Otherwise, the
+ * number of commits replayed.
+ */
+int journal_replay(int (*apply)(const void *data, size_t len));
+
+/**
+ * journal_reset - Empty the journal
+ *
+ * Discard every commit of the journal, once their content has been written to
+ * its final location on disk. Everything written so far reaches the disk before
+ * the journal is emptied there, and the journal is empty on disk on return.
+ *
+ * Return: -1 if the journal cannot be written. 0 otherwise.
+ */
+int journal_reset(void);
+
+/**
+ * journal_commit - Append a commit to the journal
+ * @data: Content of the commit
+ * @len: Length of @data in bytes
+ *
+ * Write @data to the journal as a single commit: after a crash, it is either
+ * replayed as a whole or not at all. Everything written so far reaches the disk
+ * before the commit, and the commit is on disk on return.
+ *
+ * Return: -1 if the commit does not fit in the journal's free space (see
+ * journal_space()) or cannot be written. 0 otherwise.
+ */
+int journal_commit(const void *data, size_t len);
+
+/**
+ * journal_space - Get journal's free space
+ *
+ * Return: the length of the largest commit that still fits in the journal.
+ */
+size_t journal_space(void);
+
+/**
+ * journal_capacity - Get journal's capacity
+ *
+ * Return: the length of the largest commit that fits in an empty journal.
+ */
+size_t journal_capacity(void);
+
+#endif /* _JOURNAL_H */
@@ -0,0 +1,195 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+#define pool_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Job submitted to the pool */
+struct pool_job {
+	int (*fn)(void *arg, size_t part);
+	void *arg;
+	size_t parts;
+	/* Next part to hand out, and number of parts done */
+	size_t next;
+	size_t done;
+	/* Some part failed */
+	bool failed;
+	/* Signaled when the last part is done */
+	pthread_cond_t finished;
+	/* Next job with parts left to hand out */
+	struct pool_job *next_job;
+};
+
+/* Pool instance description */
+struct pool {
+	/* Pool is started, or its threads are asked to exit */
+	bool started;
+	bool stopping;
+	/* Worker threads */
+	pthread_t *threads;
+	size_t count;
+	/* Lock of the whole pool, and condition signaled when jobs arrive */
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	/* Jobs with parts left to hand out, oldest first */
+	struct pool_job *jobs;
+};
+
+static struct pool pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+};
+
+/* hands out the next part of @job, which leaves the job list with its last
+ * part; called with the pool lock held */
+static size_t take_part(struct pool_job *job)
+{
+	struct pool_job **link;
+	size_t part = job->next++;
+
+	if (job->next == job->parts) {
+		for (link = &pool.jobs; *link != job; link = &(*link)->next_job)
+			;
+		*link = job->next_job;
+	}
+
+	return part;
+}
+
+/* runs a part of @job; called with the pool lock held, which is released
+ * during the call */
+static void run_part(struct pool_job *job, size_t part)
+{
+	int ret;
+
+	pthread_mutex_unlock(&pool.lock);
+	ret = job->fn(job->arg, part);
+	pthread_mutex_lock(&pool.lock);
+
+	if (ret)
+		job->failed = true;
+	if (++job->done == job->parts)
+		pthread_cond_signal(&job->finished);
+}
+
+static void *worker(void *arg)
+{
+	struct pool_job *job;
+
+	(void)arg;
+
+	pthread_mutex_lock(&pool.lock);
+	while (!pool.stopping) {
+		job = pool.jobs;
+		if (job)
+			run_part(job, take_part(job));
+		else
+			pthread_cond_wait(&pool.work, &pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	return NULL;
+}
+
+int pool_start(size_t threads)
+{
+	size_t i;
+
+	if (pool.started || threads == 0) {
+		pool_error("already started or no threads");
+		return -1;
+	}
+
+	pool.threads = malloc(threads * sizeof(*pool.threads));
+	if (!pool.threads) {
+		perror("malloc");
+		return -1;
+	}
+
+	pool.stopping = false;
+	pool.jobs = NULL;
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&pool.threads[i], NULL, worker, NULL)) {
+			pool_error("cannot create thread");
+			break;
+		}
+	}
+	pool.count = i;
+	pool.started = true;
+
+	if (i < threads) {
+		pool_stop();
+		return -1;
+	}
+
+	return 0;
+}
+
+int pool_stop(void)
+{
+	size_t i;
+
+	if (!pool.started) {
+		pool_error("no pool started");
+		return -1;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stopping = true;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i = 0; i < pool.count; i++)
+		pthread_join(pool.threads[i], NULL);
+
+	free(pool.threads);
+	pool.threads = NULL;
+	pool.count = 0;
+	pool.started = false;
+
+	return 0;
+}
+
+int pool_run(int (*fn)(void *arg, size_t part), void *arg, size_t parts)
+{
+	struct pool_job job = {
+		.fn = fn,
+		.arg = arg,
+		.parts = parts,
+	};
+	struct pool_job **link;
+	size_t i;
+
+	if (parts == 0)
+		return 0;
+
+	if (!pool.started || parts == 1) {
+		for (i = 0; i < parts; i++)
+			if (fn(arg, i))
+				job.failed = true;
+		return job.failed ? -1 : 0;
+	}
+
+	pthread_cond_init(&job.finished, NULL);
+
+	pthread_mutex_lock(&pool.lock);
+	for (link = &pool.jobs; *link; link = &(*link)->next_job)
+		;
+	*link = &job;
+	pthread_cond_broadcast(&pool.work);
+
+	/* work on the job too, then wait for the parts the workers took */
+	while (job.next < job.parts)
+		run_part(&job, take_part(&job));
+	while (job.done < job.parts)
+		pthread_cond_wait(&job.finished, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+
+	pthread_cond_destroy(&job.finished);
+
+	return job.failed ? -1 : 0;
+}
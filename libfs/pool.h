@@ -0,0 +1,44 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stddef.h> /* for size_t definition */
+
+/**
+ * pool_start - Start the worker pool
+ * @threads: Number of worker threads
+ *
+ * Start @threads worker threads, which wait for jobs submitted with
+ * pool_run().
+ *
+ * Return: -1 if the pool is already started, if @threads is 0, or if the
+ * threads cannot be created. 0 otherwise.
+ */
+int pool_start(size_t threads);
+
+/**
+ * pool_stop - Stop the worker pool
+ *
+ * Wait for the worker threads to exit. Must not run concurrently with
+ * pool_run().
+ *
+ * Return: -1 if the pool was not started. 0 otherwise.
+ */
+int pool_stop(void);
+
+/**
+ * pool_run - Run a job split in parts
+ * @fn: Function called on each part
+ * @arg: Argument passed to @fn
+ * @parts: Number of parts
+ *
+ * Call @fn(@arg, i) for each i from 0 to @parts - 1, and wait for every call
+ * to return. The calls are spread across the worker threads and the calling
+ * thread, which handles the parts that no worker took, so a job completes even
+ * while every worker is busy. Without a started pool, the calling thread makes
+ * every call. Function @fn returns -1 on failure, 0 otherwise.
+ *
+ * Return: -1 if a call to @fn failed. 0 otherwise.
+ */
+int pool_run(int (*fn)(void *arg, size_t part), void *arg, size_t parts);
+
+#endif /* _POOL_H */
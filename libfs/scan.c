@@ -0,0 +1,137 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+#include "scan.h"
+
+typedef size_t (*scan_fn)(const uint32_t *table, size_t count, uint64_t *map);
+
+/* builds the bitmap words of entries @first to @count - 1, where @first is a
+ * multiple of 64 */
+static size_t scan_scalar_from(const uint32_t *table, size_t first,
+			       size_t count, uint64_t *map)
+{
+	size_t j, free = 0;
+	uint64_t bits = 0;
+
+	for (j = first; j < count; j++) {
+		bits |= (uint64_t)(table[j] == 0) << (j % 64);
+		if (j % 64 == 63 || j + 1 == count) {
+			map[j / 64] = bits;
+			free += __builtin_popcountll(bits);
+			bits = 0;
+		}
+	}
+
+	return free;
+}
+
+static size_t scan_scalar(const uint32_t *table, size_t count, uint64_t *map)
+{
+	return scan_scalar_from(table, 0, count, map);
+}
+
+#ifdef SCAN_X86
+/* 4 entries per comparison, packed by fours into 16 mask bits */
+__attribute__((target("sse2")))
+static size_t scan_sse2(const uint32_t *table, size_t count, uint64_t *map)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const uint32_t *p;
+	size_t w, k, free = 0;
+	__m128i a, b, c, d;
+	uint64_t bits;
+
+	for (w = 0; w < count / 64; w++) {
+		bits = 0;
+		for (k = 0; k < 4; k++) {
+			p = table + w * 64 + k * 16;
+			a = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)p),
+					    zero);
+			b = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)
+							    (p + 4)), zero);
+			c = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)
+							    (p + 8)), zero);
+			d = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)
+							    (p + 12)), zero);
+			a = _mm_packs_epi16(_mm_packs_epi32(a, b),
+					    _mm_packs_epi32(c, d));
+			bits |= (uint64_t)(uint16_t)_mm_movemask_epi8(a) <<
+				(k * 16);
+		}
+		map[w] = bits;
+		free += __builtin_popcountll(bits);
+	}
+
+	return free + scan_scalar_from(table, w * 64, count, map);
+}
+
+/* 8 entries per comparison, packed by fours into 32 mask bits */
+__attribute__((target("avx2")))
+static size_t scan_avx2(const uint32_t *table, size_t count, uint64_t *map)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	const uint32_t *p;
+	size_t w, k, free = 0;
+	__m256i a, b, c, d;
+	uint64_t bits;
+
+	for (w = 0; w < count / 64; w++) {
+		bits = 0;
+		for (k = 0; k < 2; k++) {
+			p = table + w * 64 + k * 32;
+			a = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)
+								  p), zero);
+			b = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)
+								  (p + 8)), zero);
+			c = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)
+								  (p + 16)), zero);
+			d = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)
+								  (p + 24)), zero);
+			a = _mm256_packs_epi16(_mm256_packs_epi32(a, b),
+					       _mm256_packs_epi32(c, d));
+			/* packing works within 128-bit lanes: put the groups
+			 * of 4 entries back in order */
+			a = _mm256_permutevar8x32_epi32(a, order);
+			bits |= (uint64_t)(uint32_t)_mm256_movemask_epi8(a) <<
+				(k * 32);
+		}
+		map[w] = bits;
+		free += __builtin_popcountll(bits);
+	}
+
+	return free + scan_scalar_from(table, w * 64, count, map);
+}
+#endif
+
+/* returns the fastest kernel the CPU supports */
+static scan_fn pick_scan(void)
+{
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return scan_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return scan_sse2;
+#endif
+	return scan_scalar;
+}
+
+size_t scan_free_entries(const uint32_t *table, size_t count, uint64_t *map)
+{
+	static scan_fn scan;
+	scan_fn fn = __atomic_load_n(&scan, __ATOMIC_RELAXED);
+
+	/* picking twice from racing threads is harmless */
+	if (!fn) {
+		fn = pick_scan();
+		__atomic_store_n(&scan, fn, __ATOMIC_RELAXED);
+	}
+
+	return fn(table, count, map);
+}
@@ -0,0 +1,22 @@
+#ifndef _SCAN_H
+#define _SCAN_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/**
+ * scan_free_entries - Find the free entries of a FAT
+ * @table: FAT entries
+ * @count: Number of entries in @table
+ * @map: Bitmap to fill, of (@count + 63) / 64 words
+ *
+ * Set bit j of @map (bit j % 64 of word j / 64) if entry j of @table is 0,
+ * and clear it otherwise, as well as the bits past @count in the last word.
+ * The entries are compared many at a time with the widest vector instructions
+ * that the CPU supports (AVX2 or SSE2), or one at a time elsewhere.
+ *
+ * Return: The number of free entries.
+ */
+size_t scan_free_entries(const uint32_t *table, size_t count, uint64_t *map);
+
+#endif /* _SCAN_H */
@@ -0,0 +1,280 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define trace_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Largest number of nested operations recorded in a thread */
+#define TRACE_OPEN_MAX 8
+
+/* Event ring of a thread */
+struct trace_ring {
+	/* Events, and their number (power of two) */
+	struct trace_event *events;
+	size_t size;
+	/* Number of events ever recorded in the ring */
+	size_t next;
+	/* Tracing session the events belong to */
+	unsigned int session;
+	/* Thread owning the ring */
+	long tid;
+	/* File operation in progress in the thread */
+	struct trace_event *current;
+	/* Numbers of the events begun and not finished yet, whose slots are
+	 * not reused meanwhile */
+	size_t open[TRACE_OPEN_MAX];
+	size_t nopen;
+	/* Next ring in the list of all rings */
+	struct trace_ring *next_ring;
+};
+
+bool trace_enabled;
+
+/* Tracing session, and size of the rings it uses */
+static unsigned int session;
+static size_t ring_size;
+
+/* Ring of each thread, and list of all rings */
+static __thread struct trace_ring *ring;
+static struct trace_ring *rings;
+
+static const char *type_names[TRACE_TYPE_COUNT] = {
+	[TRACE_FS_MOUNT] = "fs_mount",
+	[TRACE_FS_UMOUNT] = "fs_umount",
+	[TRACE_FS_SYNC] = "fs_sync",
+	[TRACE_FS_CREATE] = "fs_create",
+	[TRACE_FS_DELETE] = "fs_delete",
+	[TRACE_FS_OPEN] = "fs_open",
+	[TRACE_FS_CLOSE] = "fs_close",
+	[TRACE_FS_FLUSH] = "fs_flush",
+	[TRACE_FS_STAT] = "fs_stat",
+	[TRACE_FS_LSEEK] = "fs_lseek",
+	[TRACE_FS_READ] = "fs_read",
+	[TRACE_FS_WRITE] = "fs_write",
+	[TRACE_BLOCK_READ] = "block_read",
+	[TRACE_BLOCK_WRITE] = "block_write",
+	[TRACE_BLOCK_AIO_READ] = "block_aio_read",
+	[TRACE_BLOCK_AIO_WRITE] = "block_aio_write",
+	[TRACE_BLOCK_AIO_WAIT] = "block_aio_wait",
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* returns the calling thread's ring, set up for the current session */
+static struct trace_ring *get_ring(void)
+{
+	struct trace_ring *r = ring;
+	struct trace_event *events;
+	unsigned int current = __atomic_load_n(&session, __ATOMIC_ACQUIRE);
+	size_t size = __atomic_load_n(&ring_size, __ATOMIC_RELAXED);
+
+	if (r && r->session == current)
+		return r;
+
+	/* operations in progress still point into the ring: set it up for the
+	 * new session once they are over, and leave events out until then */
+	if (r && r->nopen)
+		return NULL;
+
+	if (!r) {
+		r = calloc(1, sizeof(*r));
+		if (!r)
+			return NULL;
+		r->tid = syscall(SYS_gettid);
+
+		/* rings are never freed, so that dumps can always walk them */
+		r->next_ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+		while (!__atomic_compare_exchange_n(&rings, &r->next_ring, r,
+						    false, __ATOMIC_RELEASE,
+						    __ATOMIC_ACQUIRE))
+			;
+		ring = r;
+	}
+
+	if (r->size != size) {
+		events = realloc(r->events, size * sizeof(*events));
+		if (!events)
+			return NULL;
+		r->events = events;
+		r->size = size;
+	}
+	r->next = 0;
+	r->current = NULL;
+	r->session = current;
+
+	return r;
+}
+
+/* tells whether event number @n would take the slot of an open event */
+static bool slot_open(const struct trace_ring *r, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < r->nopen; i++) {
+		if (((r->open[i] ^ n) & (r->size - 1)) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+struct trace_event *trace_record(enum trace_type type)
+{
+	struct trace_ring *r = get_ring();
+	struct trace_event *ev;
+
+	if (!r || r->nopen == TRACE_OPEN_MAX || r->nopen == r->size)
+		return NULL;
+
+	/* the oldest events get overwritten, but for the open ones */
+	while (slot_open(r, r->next))
+		r->next++;
+	r->open[r->nopen++] = r->next;
+	ev = &r->events[r->next++ & (r->size - 1)];
+	memset(ev, 0, sizeof(*ev));
+	ev->fd = -1;
+	ev->type = type;
+	ev->begin = now_ns();
+
+	if (type < TRACE_BLOCK_READ && !r->current)
+		r->current = ev;
+
+	return ev;
+}
+
+void trace_finish(struct trace_event *ev, int64_t ret)
+{
+	struct trace_ring *r = ring;
+	size_t i;
+
+	ev->end = now_ns();
+	ev->ret = ret;
+
+	if (!r)
+		return;
+
+	if (r->current == ev)
+		r->current = NULL;
+
+	for (i = 0; i < r->nopen; i++) {
+		if (&r->events[r->open[i] & (r->size - 1)] == ev) {
+			r->open[i] = r->open[--r->nopen];
+			break;
+		}
+	}
+}
+
+void trace_touch(size_t block)
+{
+	struct trace_event *ev = ring ? ring->current : NULL;
+
+	if (ev && !ev->has_block) {
+		ev->block = block;
+		ev->has_block = true;
+	}
+}
+
+int trace_start(size_t events)
+{
+	size_t size = 1;
+
+	if (events == 0) {
+		trace_error("empty ring");
+		return -1;
+	}
+
+	while (size < events)
+		size <<= 1;
+
+	/* threads set their ring up again at their next event */
+	__atomic_store_n(&ring_size, size, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&session, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&trace_enabled, true, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+int trace_stop(void)
+{
+	if (!trace_enabled) {
+		trace_error("tracing not started");
+		return -1;
+	}
+
+	__atomic_store_n(&trace_enabled, false, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static void dump_event(FILE *f, const struct trace_ring *r,
+		       const struct trace_event *ev, bool first)
+{
+	fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+		"\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%ld,\"args\":{",
+		first ? "" : ",", type_names[ev->type],
+		ev->type < TRACE_BLOCK_READ ? "fs" : "disk", ev->begin / 1e3,
+		(ev->end - ev->begin) / 1e3, (int)getpid(), r->tid);
+
+	if (ev->type < TRACE_BLOCK_READ)
+		fprintf(f, "\"fd\":%d,\"offset\":%llu,\"length\":%llu,",
+			ev->fd, (unsigned long long)ev->offset,
+			(unsigned long long)ev->length);
+	if (ev->type >= TRACE_BLOCK_READ || ev->has_block)
+		fprintf(f, "\"block\":%llu,\"count\":%u,",
+			(unsigned long long)ev->block, ev->count);
+	fprintf(f, "\"ret\":%lld}}", (long long)ev->ret);
+}
+
+int trace_dump(const char *filename)
+{
+	const struct trace_ring *r;
+	const struct trace_event *ev;
+	size_t i, start;
+	bool first = true;
+	FILE *f;
+
+	f = fopen(filename, "w");
+	if (!f) {
+		perror("fopen");
+		return -1;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r;
+	     r = r->next_ring) {
+		if (r->session != session || !r->size)
+			continue;
+
+		start = r->next > r->size ? r->next - r->size : 0;
+		for (i = start; i < r->next; i++) {
+			ev = &r->events[i & (r->size - 1)];
+			/* skip operations still in progress */
+			if (ev->end < ev->begin)
+				continue;
+			dump_event(f, r, ev, first);
+			first = false;
+		}
+	}
+	fprintf(f, "\n]}\n");
+
+	if (fclose(f)) {
+		perror("fclose");
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,137 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/*
+ * USDT probes, built with `make USDT=1` where <sys/sdt.h> is available: each
+ * traced operation fires probe libfs:op_begin with its type, and probe
+ * libfs:op_end with its return value, whether tracing is started or not.
+ * Operations nest (block operations within file operations), so the ends
+ * match the begins of each thread in reverse order.
+ */
+#if defined(TRACE_USDT) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE(name, arg) DTRACE_PROBE1(libfs, name, arg)
+#else
+#define TRACE_PROBE(name, arg) do { } while (0)
+#endif
+
+/* Traced operations */
+enum trace_type {
+	TRACE_FS_MOUNT,
+	TRACE_FS_UMOUNT,
+	TRACE_FS_SYNC,
+	TRACE_FS_CREATE,
+	TRACE_FS_DELETE,
+	TRACE_FS_OPEN,
+	TRACE_FS_CLOSE,
+	TRACE_FS_FLUSH,
+	TRACE_FS_STAT,
+	TRACE_FS_LSEEK,
+	TRACE_FS_READ,
+	TRACE_FS_WRITE,
+	TRACE_BLOCK_READ,
+	TRACE_BLOCK_WRITE,
+	TRACE_BLOCK_AIO_READ,
+	TRACE_BLOCK_AIO_WRITE,
+	TRACE_BLOCK_AIO_WAIT,
+	TRACE_TYPE_COUNT
+};
+
+/* Traced operation: file operations fill in @fd, @offset and @length, and
+ * block operations @block and @count; @block is the first physical block
+ * touched by a file operation, if any */
+struct trace_event {
+	uint64_t begin;
+	uint64_t end;
+	uint64_t offset;
+	uint64_t length;
+	uint64_t block;
+	int64_t ret;
+	int32_t fd;
+	uint32_t count;
+	uint16_t type;
+	bool has_block;
+};
+
+/* Tracing is enabled */
+extern bool trace_enabled;
+
+/* Records the beginning of an operation in the calling thread's ring */
+struct trace_event *trace_record(enum trace_type type);
+
+/* Records the end of a traced operation */
+void trace_finish(struct trace_event *ev, int64_t ret);
+
+/* Sets the first physical block touched by the current file operation */
+void trace_touch(size_t block);
+
+/*
+ * The functions below are the ones to call around operations: they cost a
+ * single predicted branch while tracing is disabled.
+ */
+static inline struct trace_event *trace_begin(enum trace_type type)
+{
+	TRACE_PROBE(op_begin, type);
+	if (__builtin_expect(!__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED),
+			     1))
+		return NULL;
+
+	return trace_record(type);
+}
+
+static inline void trace_end(struct trace_event *ev, int64_t ret)
+{
+	TRACE_PROBE(op_end, ret);
+	if (__builtin_expect(ev != NULL, 0))
+		trace_finish(ev, ret);
+}
+
+static inline void trace_block(size_t block)
+{
+	if (__builtin_expect(__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED),
+			     0))
+		trace_touch(block);
+}
+
+/**
+ * trace_start - Start tracing
+ * @events: Number of events kept per thread
+ *
+ * Discard the events of the previous tracing session and start recording
+ * operations. Each thread records its operations in a ring of @events events
+ * (rounded up to a power of two), where the oldest events get overwritten, but
+ * for the ones of operations still in progress. A thread in the middle of an
+ * operation moves to the new session once the operation is over, and records
+ * nothing until then.
+ *
+ * Return: -1 if @events is 0. 0 otherwise.
+ */
+int trace_start(size_t events);
+
+/**
+ * trace_stop - Stop tracing
+ *
+ * Stop recording operations, leaving the recorded events in place for
+ * trace_dump().
+ *
+ * Return: -1 if tracing was not started. 0 otherwise.
+ */
+int trace_stop(void);
+
+/**
+ * trace_dump - Write the recorded events to a file
+ * @filename: File name
+ *
+ * Write the events recorded during the last tracing session to file @filename
+ * in Chrome trace event format (JSON), which chrome://tracing and Perfetto can
+ * load. Must not run concurrently with traced operations.
+ *
+ * Return: -1 if @filename cannot be written. 0 otherwise.
+ */
+int trace_dump(const char *filename);
+
+#endif /* _TRACE_H */
@@ -0,0 +1,501 @@
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define bench_fs_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	bench_fs_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Number of files kept alive by the churn workload */
+#define CHURN_FILES 8
+
+/* Number of operations kept in a trace */
+#define TRACE_EVENTS 65536
+
+/* Benchmark configuration */
+struct bench_config {
+	char *diskname;
+	size_t file_size;
+	size_t io_size;
+	size_t ops;
+	unsigned int seed;
+	int json;
+	char *trace;
+	struct fs_options opts;
+};
+
+/* Measurements of a workload */
+struct bench_result {
+	const char *name;
+	size_t ops;
+	size_t bytes;
+	double seconds;
+	/* latency of each operation, in nanoseconds */
+	uint64_t *lat;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void bench_mount(struct bench_config *cfg)
+{
+	if (fs_mount_opts(cfg->diskname, &cfg->opts))
+		die("Cannot mount diskname");
+}
+
+static void bench_umount(void)
+{
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+static int bench_open(const char *filename, int create)
+{
+	int fd;
+
+	if (create && fs_create(filename))
+		die("Cannot create file '%s'", filename);
+
+	fd = fs_open(filename);
+	if (fd < 0)
+		die("Cannot open file '%s'", filename);
+
+	return fd;
+}
+
+/* records latency of operation @i, started at @start */
+static void record(struct bench_result *res, size_t i, uint64_t start)
+{
+	res->lat[i] = now_ns() - start;
+}
+
+static void bench_seqwrite(struct bench_config *cfg, struct bench_result *res,
+			   char *buf)
+{
+	size_t off, len, i = 0;
+	uint64_t start;
+	int fd;
+
+	fd = bench_open("bench", 1);
+	for (off = 0; off < cfg->file_size; off += len) {
+		len = cfg->file_size - off < cfg->io_size ?
+			cfg->file_size - off : cfg->io_size;
+		start = now_ns();
+		if (fs_write(fd, buf, len) != (int)len)
+			die("Disk full");
+		record(res, i++, start);
+	}
+	if (fs_close(fd) || fs_sync())
+		die("Cannot flush file");
+
+	res->ops = i;
+	res->bytes = cfg->file_size;
+}
+
+static void bench_seqread(struct bench_config *cfg, struct bench_result *res,
+			  char *buf)
+{
+	size_t i = 0, bytes = 0;
+	uint64_t start;
+	int fd, ret;
+
+	fd = bench_open("bench", 0);
+	do {
+		start = now_ns();
+		ret = fs_read(fd, buf, cfg->io_size);
+		if (ret < 0)
+			die("Cannot read file");
+		record(res, i++, start);
+		bytes += ret;
+	} while (ret > 0 && i < res->ops);
+	fs_close(fd);
+
+	res->ops = i;
+	res->bytes = bytes;
+}
+
+static void bench_random(struct bench_config *cfg, struct bench_result *res,
+			 char *buf, int write)
+{
+	size_t i, off, span;
+	uint64_t start;
+	int fd;
+
+	if (cfg->file_size < cfg->io_size)
+		die("File size smaller than I/O size");
+	span = cfg->file_size - cfg->io_size + 1;
+
+	fd = bench_open("bench", 0);
+	for (i = 0; i < res->ops; i++) {
+		off = ((size_t)rand() * RAND_MAX + rand()) % span;
+		start = now_ns();
+		if (fs_lseek(fd, off))
+			die("Cannot seek file");
+		if (write ? fs_write(fd, buf, cfg->io_size) != (int)cfg->io_size :
+		    fs_read(fd, buf, cfg->io_size) != (int)cfg->io_size)
+			die("Cannot %s file", write ? "write" : "read");
+		record(res, i, start);
+	}
+	if (fs_close(fd) || (write && fs_sync()))
+		die("Cannot flush file");
+
+	res->bytes = res->ops * cfg->io_size;
+}
+
+static void bench_randwrite(struct bench_config *cfg, struct bench_result *res,
+			    char *buf)
+{
+	bench_random(cfg, res, buf, 1);
+}
+
+static void bench_randread(struct bench_config *cfg, struct bench_result *res,
+			   char *buf)
+{
+	bench_random(cfg, res, buf, 0);
+}
+
+static void bench_append(struct bench_config *cfg, struct bench_result *res,
+			 char *buf)
+{
+	size_t i;
+	uint64_t start;
+	int fd;
+
+	fd = bench_open("append", 1);
+	for (i = 0; i < res->ops; i++) {
+		start = now_ns();
+		if (fs_write(fd, buf, cfg->io_size) != (int)cfg->io_size)
+			die("Disk full");
+		record(res, i, start);
+	}
+	if (fs_close(fd) || fs_delete("append") || fs_sync())
+		die("Cannot flush file");
+
+	res->bytes = res->ops * cfg->io_size;
+}
+
+static void bench_churn(struct bench_config *cfg, struct bench_result *res,
+			char *buf)
+{
+	char filename[FS_FILENAME_LEN];
+	size_t i;
+	uint64_t start;
+	int fd;
+
+	for (i = 0; i < res->ops; i++) {
+		snprintf(filename, sizeof(filename), "churn%zu", i % CHURN_FILES);
+		start = now_ns();
+		/* replace an older file of the same name */
+		if (i >= CHURN_FILES && fs_delete(filename))
+			die("Cannot delete file '%s'", filename);
+		fd = bench_open(filename, 1);
+		if (fs_write(fd, buf, cfg->io_size) != (int)cfg->io_size)
+			die("Disk full");
+		if (fs_close(fd))
+			die("Cannot close file");
+		record(res, i, start);
+	}
+
+	for (i = 0; i < CHURN_FILES && i < res->ops; i++) {
+		snprintf(filename, sizeof(filename), "churn%zu", i);
+		fs_delete(filename);
+	}
+	if (fs_sync())
+		die("Cannot sync");
+
+	res->bytes = res->ops * cfg->io_size;
+}
+
+static struct {
+	const char *name;
+	void(*func)(struct bench_config *, struct bench_result *, char *);
+	/* workload works on the test file written by seqwrite */
+	int needs_file;
+} workloads[] = {
+	{ "seqwrite",	bench_seqwrite,		0 },
+	{ "seqread",	bench_seqread,		1 },
+	{ "randwrite",	bench_randwrite,	1 },
+	{ "randread",	bench_randread,		1 },
+	{ "append",	bench_append,		0 },
+	{ "churn",	bench_churn,		0 }
+};
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* returns percentile @p of the sorted latencies, in microseconds */
+static double percentile(struct bench_result *res, double p)
+{
+	size_t i;
+
+	if (!res->ops)
+		return 0;
+
+	i = (size_t)(p * res->ops + 0.999999);
+	if (i > 0)
+		i--;
+	if (i >= res->ops)
+		i = res->ops - 1;
+
+	return res->lat[i] / 1000.0;
+}
+
+static void print_header(struct bench_config *cfg)
+{
+	if (cfg->json) {
+		printf("{\n\t\"config\": {\"file_size\": %zu, \"io_size\": %zu, "
+		       "\"ops\": %zu, \"seed\": %u, \"cache_blocks\": %zu, "
+		       "\"map_disk\": %d, \"delay_alloc\": %d, "
+		       "\"journal_blocks\": %zu, \"io_depth\": %u, "
+		       "\"read_threads\": %u},\n"
+		       "\t\"results\": [",
+		       cfg->file_size, cfg->io_size, cfg->ops, cfg->seed,
+		       cfg->opts.cache_blocks, cfg->opts.map_disk,
+		       cfg->opts.delay_alloc, cfg->opts.journal_blocks,
+		       cfg->opts.io_depth, cfg->opts.read_threads);
+		return;
+	}
+
+	printf("%-10s %8s %10s %12s %10s %10s %10s\n", "workload", "ops",
+	       "MB/s", "ops/s", "p50(us)", "p99(us)", "p999(us)");
+}
+
+static void print_result(struct bench_config *cfg, struct bench_result *res,
+			 int first)
+{
+	double mbs = res->seconds > 0 ? res->bytes / 1e6 / res->seconds : 0;
+	double ops = res->seconds > 0 ? res->ops / res->seconds : 0;
+
+	qsort(res->lat, res->ops, sizeof(*res->lat), cmp_u64);
+
+	if (cfg->json) {
+		printf("%s\n\t\t{\"workload\": \"%s\", \"ops\": %zu, "
+		       "\"bytes\": %zu, \"seconds\": %.6f, \"mb_per_s\": %.3f, "
+		       "\"ops_per_s\": %.3f, \"p50_us\": %.3f, "
+		       "\"p99_us\": %.3f, \"p999_us\": %.3f}",
+		       first ? "" : ",", res->name, res->ops, res->bytes,
+		       res->seconds, mbs, ops, percentile(res, 0.50),
+		       percentile(res, 0.99), percentile(res, 0.999));
+		return;
+	}
+
+	printf("%-10s %8zu %10.2f %12.1f %10.2f %10.2f %10.2f\n", res->name,
+	       res->ops, mbs, ops, percentile(res, 0.50), percentile(res, 0.99),
+	       percentile(res, 0.999));
+}
+
+static void print_footer(struct bench_config *cfg)
+{
+	if (cfg->json)
+		printf("\n\t]\n}\n");
+}
+
+size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX || ret < 0)
+		die_perror("strtol");
+	return (size_t)ret;
+}
+
+void usage(char *program)
+{
+	size_t i;
+	fprintf(stderr, "Usage: %s [<option>...] <diskname> [<workload>...]\n",
+		program);
+	fprintf(stderr, "Options are:\n");
+	fprintf(stderr, "\t-s <bytes>\tfile size (default 1048576)\n");
+	fprintf(stderr, "\t-b <bytes>\tI/O size (default 4096)\n");
+	fprintf(stderr, "\t-n <count>\toperations of random, append and "
+		"churn workloads (default 1000)\n");
+	fprintf(stderr, "\t-r <seed>\trandom seed (default 1)\n");
+	fprintf(stderr, "\t-c <blocks>\tblock cache size (default %d)\n",
+		FS_CACHE_BLOCKS);
+	fprintf(stderr, "\t-q <depth>\tI/O queue depth (default %d)\n",
+		FS_IO_DEPTH);
+	fprintf(stderr, "\t-p <threads>\tthreads per large read (default %d)\n",
+		FS_READ_THREADS);
+	fprintf(stderr, "\t-j <blocks>\tjournal size, added for good to a disk "
+		"without one (default none)\n");
+	fprintf(stderr, "\t-a\t\tdelayed allocation\n");
+	fprintf(stderr, "\t-m\t\tmemory-mapped disk\n");
+	fprintf(stderr, "\t-J\t\tJSON output\n");
+	fprintf(stderr, "\t-t <file>\twrite a trace of the last %d operations "
+		"to file\n", TRACE_EVENTS);
+	fprintf(stderr, "Possible workloads are (all by default):\n");
+	for (i = 0; i < ARRAY_SIZE(workloads); i++)
+		fprintf(stderr, "\t%s\n", workloads[i].name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_config cfg = {
+		.file_size = 1 << 20,
+		.io_size = 4096,
+		.ops = 1000,
+		.seed = 1,
+		.opts = {
+			.cache_blocks = FS_CACHE_BLOCKS,
+			.io_depth = FS_IO_DEPTH,
+			.read_threads = FS_READ_THREADS,
+		},
+	};
+	struct bench_result res;
+	char *program, *buf;
+	size_t i, j, maxops;
+	uint64_t start;
+	int opt, fd, first = 1, selected;
+
+	program = argv[0];
+
+	while ((opt = getopt(argc, argv, "s:b:n:r:c:q:p:j:amJt:")) != -1) {
+		switch (opt) {
+		case 's':
+			cfg.file_size = get_argv(optarg);
+			break;
+		case 'b':
+			cfg.io_size = get_argv(optarg);
+			break;
+		case 'n':
+			cfg.ops = get_argv(optarg);
+			break;
+		case 'r':
+			cfg.seed = get_argv(optarg);
+			break;
+		case 'c':
+			cfg.opts.cache_blocks = get_argv(optarg);
+			break;
+		case 'q':
+			cfg.opts.io_depth = get_argv(optarg);
+			break;
+		case 'p':
+			cfg.opts.read_threads = get_argv(optarg);
+			break;
+		case 'j':
+			cfg.opts.journal_blocks = get_argv(optarg);
+			break;
+		case 'a':
+			cfg.opts.delay_alloc = 1;
+			break;
+		case 'm':
+			cfg.opts.map_disk = 1;
+			break;
+		case 'J':
+			cfg.json = 1;
+			break;
+		case 't':
+			cfg.trace = optarg;
+			break;
+		default:
+			usage(program);
+		}
+	}
+
+	if (optind >= argc || !cfg.io_size || cfg.io_size > INT_MAX)
+		usage(program);
+	cfg.diskname = argv[optind++];
+
+	/* check workload names before doing anything */
+	for (i = optind; i < (size_t)argc; i++) {
+		for (j = 0; j < ARRAY_SIZE(workloads); j++)
+			if (!strcmp(argv[i], workloads[j].name))
+				break;
+		if (j == ARRAY_SIZE(workloads)) {
+			bench_fs_error("invalid workload '%s'", argv[i]);
+			usage(program);
+		}
+	}
+
+	buf = malloc(cfg.io_size);
+	maxops = cfg.file_size / cfg.io_size + 1;
+	if (maxops < cfg.ops)
+		maxops = cfg.ops;
+	res.lat = malloc(maxops * sizeof(*res.lat));
+	if (!buf || !res.lat)
+		die_perror("malloc");
+	memset(buf, 0xA5, cfg.io_size);
+	srand(cfg.seed);
+
+	/* the test file is created by the first workload that needs it */
+	bench_mount(&cfg);
+	fs_delete("bench");
+	bench_umount();
+
+	if (cfg.trace && fs_trace_start(TRACE_EVENTS))
+		die("Cannot start tracing");
+
+	print_header(&cfg);
+	for (j = 0; j < ARRAY_SIZE(workloads); j++) {
+		selected = optind == argc;
+		for (i = optind; i < (size_t)argc; i++)
+			if (!strcmp(argv[i], workloads[j].name))
+				selected = 1;
+		if (!selected)
+			continue;
+
+		/* each workload starts from a fresh mount, with a cold cache */
+		bench_mount(&cfg);
+		if (workloads[j].needs_file) {
+			fd = fs_open("bench");
+			if (fd < 0) {
+				bench_umount();
+				die("Run seqwrite first to create the test file");
+			}
+			fs_close(fd);
+		}
+
+		res.name = workloads[j].name;
+		res.ops = workloads[j].func == bench_seqread ? maxops : cfg.ops;
+		res.bytes = 0;
+		start = now_ns();
+		workloads[j].func(&cfg, &res, buf);
+		res.seconds = (now_ns() - start) / 1e9;
+		bench_umount();
+
+		print_result(&cfg, &res, first);
+		first = 0;
+	}
+	print_footer(&cfg);
+
+	if (cfg.trace && (fs_trace_stop() || fs_trace_dump(cfg.trace)))
+		die("Cannot write trace");
+
+	/* remove the test file; a journal added by -j stays on the disk */
+	bench_mount(&cfg);
+	fs_delete("bench");
+	bench_umount();
+
+	free(buf);
+	free(res.lat);
+
+	return 0;
+}
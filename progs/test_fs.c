@@ -264,6 +264,118 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
+static void print_latency(const char *name, unsigned long long *hist)
+{
+	int i;
+
+	for (i = 0; i < FS_LAT_BUCKETS; i++) {
+		if (hist[i])
+			printf("%s_lat_lt_%lluns=%llu\n", name, 1ULL << i,
+			       hist[i]);
+	}
+}
+
+void thread_fs_stats(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_stats stats;
+	char *diskname, *buf;
+	int i, fs_fd, stat;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<filename>...]");
+
+	diskname = t_arg->argv[0];
+
+	fs_reset_stats();
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* read the given files through, as a workload */
+	for (i = 1; i < t_arg->argc; i++) {
+		fs_fd = fs_open(t_arg->argv[i]);
+		if (fs_fd < 0) {
+			fs_umount();
+			die("Cannot open file");
+		}
+
+		stat = fs_stat(fs_fd);
+		buf = malloc(stat > 0 ? stat : 1);
+		if (!buf) {
+			perror("malloc");
+			fs_umount();
+			die("Cannot malloc");
+		}
+		if (fs_read(fs_fd, buf, stat) != stat) {
+			fs_umount();
+			die("Cannot read file");
+		}
+		free(buf);
+
+		if (fs_close(fs_fd)) {
+			fs_umount();
+			die("Cannot close file");
+		}
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	fs_get_stats(&stats);
+
+	printf("FS Stats:\n");
+	printf("block_reads=%llu\n", stats.block_reads);
+	printf("block_writes=%llu\n", stats.block_writes);
+	printf("bytes_read=%llu\n", stats.bytes_read);
+	printf("bytes_written=%llu\n", stats.bytes_written);
+	printf("fat_steps=%llu\n", stats.fat_steps);
+	printf("blocks_allocated=%llu\n", stats.blocks_allocated);
+	printf("create_calls=%llu\n", stats.create_calls);
+	printf("delete_calls=%llu\n", stats.delete_calls);
+	printf("open_calls=%llu\n", stats.open_calls);
+	printf("close_calls=%llu\n", stats.close_calls);
+	printf("stat_calls=%llu\n", stats.stat_calls);
+	printf("lseek_calls=%llu\n", stats.lseek_calls);
+	printf("read_calls=%llu\n", stats.read_calls);
+	printf("write_calls=%llu\n", stats.write_calls);
+	printf("fanout_reads=%llu\n", stats.fanout_reads);
+	print_latency("read", stats.read_latency);
+	print_latency("write", stats.write_latency);
+}
+
+void thread_fs_check(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int repair, problems;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [-r]");
+
+	diskname = t_arg->argv[0];
+	repair = t_arg->argc > 1 && !strcmp(t_arg->argv[1], "-r");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	problems = fs_check(repair);
+	if (problems < 0) {
+		fs_umount();
+		die("Cannot check diskname");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("FS Check:\n");
+	printf("problems=%d\n", problems);
+
+	/* let scripts gate on a clean disk */
+	if (problems && !repair)
+		exit(1);
+}
+
 size_t get_argv(char *argv)
 {
 	long int ret = strtol(argv, NULL, 0);
@@ -272,6 +384,101 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+void thread_fs_defrag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	size_t max_blocks = 0;
+	int moved;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<max blocks>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		max_blocks = get_argv(t_arg->argv[1]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	moved = fs_defrag(max_blocks);
+	if (moved < 0) {
+		fs_umount();
+		die("Cannot defragment diskname");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("FS Defrag:\n");
+	printf("blocks_moved=%d\n", moved);
+}
+
+void thread_fs_format(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int format = FS_FORMAT_FAT16;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [16|32]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1) {
+		if (!strcmp(t_arg->argv[1], "32"))
+			format = FS_FORMAT_FAT32;
+		else if (strcmp(t_arg->argv[1], "16"))
+			die("FAT entries are 16 or 32 bits");
+	}
+
+	if (fs_format(diskname, format))
+		die("Cannot format diskname");
+}
+
+void thread_fs_remount(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	int fs_fd;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	if (fs_close(fs_fd) || fs_umount())
+		die("Cannot unmount diskname");
+
+	/* nothing of the last mount is left to open the file through */
+	if (fs_open(filename) >= 0)
+		die("Opened file while unmounted");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname again");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file again");
+	}
+
+	if (fs_close(fs_fd) || fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("FS Remount:\n");
+	printf("file '%s' opened across two mounts\n", filename);
+}
+
 static struct {
 	const char *name;
 	void(*func)(void *);
@@ -281,7 +488,12 @@ static struct {
 	{ "add",	thread_fs_add },
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
-	{ "stat",	thread_fs_stat }
+	{ "stat",	thread_fs_stat },
+	{ "stats",	thread_fs_stats },
+	{ "check",	thread_fs_check },
+	{ "defrag",	thread_fs_defrag },
+	{ "format",	thread_fs_format },
+	{ "remount",	thread_fs_remount }
 };
 
 void usage(char *program)